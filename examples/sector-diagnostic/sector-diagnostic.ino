@@ -13,10 +13,25 @@ void setup() {
   pinMode(LORA_RESET, OUTPUT);
   digitalWrite(LORA_RESET, LOW);
   CustoFlash.beginWork();
+
+  BacklogReport_t report = CustoFlash.getDeviceReport();
+  Serial.print("Unsent records: ");
+  Serial.println(report.unsentRecords);
+  Serial.print("Sectors with unsent records: ");
+  Serial.println(report.backlogSectors);
+  Serial.print("Free sectors: ");
+  Serial.print(report.freeSectors);
+  Serial.print("/");
+  Serial.println(report.ringSectors);
+  Serial.print("Ring utilisation: ");
+  Serial.print(report.utilisation);
+  Serial.println("%");
+
+  sectorIndex = SerialFlashLayout::getPartitionStart();
 }
 
 void loop() {
-  if (sectorIndex >= MAX_SECTOR) {
+  if (!SerialFlashLayout::isPartitionSector(sectorIndex)) {
     Serial.println();
     Serial.println("Sector diagnostic completed,");
     Serial.println("Device halted.");
@@ -28,6 +43,7 @@ void loop() {
   Serial.println(sectorIndex);
 
   SerialFlashSector sector = CustoFlash.getSector(sectorIndex);
+  SectorStats_t stats = sector.getStats();
 
   if (sector.isBlank()) {
     Serial.println("Blank sector check...");
@@ -44,15 +60,15 @@ void loop() {
     Serial.print("Record size: ");
     Serial.println(sector.getRecordSize());
     Serial.print("Written records: ");
-    Serial.print(sector.getWrittenCount());
+    Serial.print(stats.written);
     Serial.print("/");
-    Serial.println(sector.getMaxCount());
+    Serial.println(stats.capacity);
     Serial.print("Unsent records: ");
-    Serial.print(sector.getUnsentCount());
+    Serial.print(stats.unsent);
     Serial.print("/");
-    Serial.println(sector.getWrittenCount());
+    Serial.println(stats.written);
 
-    if (sector.getWrittenCount() >= RECORDS_SHOWN) {
+    if (stats.written >= RECORDS_SHOWN) {
       Serial.print("First 5 records of sector ");
       Serial.print(sectorIndex);
       Serial.println(":");
@@ -73,12 +89,12 @@ void loop() {
       }
     } else {
       Serial.print("First ");
-      Serial.print(sector.getWrittenCount());
+      Serial.print(stats.written);
       Serial.print(" records of sector ");
       Serial.print(sectorIndex);
       Serial.println(":");
 
-      for (int i = 0; i < sector.getWrittenCount(); i++) {
+      for (int i = 0; i < stats.written; i++) {
         SerialFlashRecord record = sector.getRecord(i);
         uint8_t recordSize = record.getRecordSize();
         uint8_t buf[recordSize];
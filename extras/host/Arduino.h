@@ -0,0 +1,84 @@
+// Minimal Arduino API for building CustoFlash on a host computer.
+// Only what the library itself uses is provided.
+#ifndef CUSTOFLASH_HOST_ARDUINO_H
+#define CUSTOFLASH_HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#define ARDUINO   10813           // API level the library is written against
+#define F(s)      (s)
+#define HEX       16
+#define DEC       10
+#define HIGH      1
+#define LOW       0
+#define INPUT     0
+#define OUTPUT    1
+
+typedef uint8_t byte;
+
+uint32_t micros();
+uint32_t millis();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+class String {
+public:
+  String(const char *s = "") : str(s) {}
+  String(unsigned long value, int base = DEC) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), base == HEX ? "%lx" : "%lu", value);
+    str = buf;
+  }
+  String(unsigned int value, int base = DEC) : String((unsigned long) value, base) {}
+  String(int value, int base = DEC) : String((unsigned long) value, base) {}
+  String(unsigned char value, int base = DEC) : String((unsigned long) value, base) {}
+  String &operator+=(const String &other) { str += other.str; return *this; }
+  String &operator+=(const char *other) { str += other; return *this; }
+  unsigned int length() const { return str.size(); }
+  const char *c_str() const { return str.c_str(); }
+private:
+  std::string str;
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  size_t print(const char *s) { size_t n = 0; while (*s) n += write(*s++); return n; }
+  size_t print(const String &s) { return print(s.c_str()); }
+  size_t print(char c) { return write(c); }
+  size_t print(unsigned long value, int base = DEC) { return print(String(value, base)); }
+  size_t print(long value, int base = DEC) {
+    if (value < 0 && base == DEC) return print('-') + print((unsigned long) -value);
+    return print((unsigned long) value, base);
+  }
+  size_t print(unsigned int value, int base = DEC) { return print((unsigned long) value, base); }
+  size_t print(int value, int base = DEC) { return print((long) value, base); }
+  size_t print(unsigned char value, int base = DEC) { return print((unsigned long) value, base); }
+  size_t print(double value, int digits = 2) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.*f", digits, value);
+    return print(buf);
+  }
+  size_t println() { return print("\n"); }
+  template <typename T> size_t println(T value) { return print(value) + println(); }
+  template <typename T> size_t println(T value, int format) { return print(value, format) + println(); }
+};
+
+class HostSerial : public Print {
+public:
+  void begin(unsigned long) {}
+  operator bool() { return true; }
+  size_t write(uint8_t c) { return fputc(c, stdout) == EOF ? 0 : 1; }
+};
+
+extern HostSerial Serial;
+
+#endif
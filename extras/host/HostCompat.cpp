@@ -0,0 +1,26 @@
+// Definitions behind Arduino.h and SPI.h for host builds.
+#include "Arduino.h"
+#include "SPI.h"
+#include <time.h>
+
+HostSerial Serial;
+SPIClass SPI;
+SPIClass SPI1;
+
+static uint64_t nowMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t micros() { return (uint32_t) nowMicros(); }
+uint32_t millis() { return (uint32_t) (nowMicros() / 1000); }
+void delay(uint32_t ms) { delayMicroseconds(ms * 1000); }
+void delayMicroseconds(uint32_t us) {
+  uint64_t end = nowMicros() + us;
+  while (nowMicros() < end) {
+  }
+}
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t value) {}
+int digitalRead(uint8_t pin) { return 0; }
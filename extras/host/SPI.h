@@ -0,0 +1,29 @@
+// SPI stubs for building CustoFlash on a host computer. Nothing is wired to
+// them: install a SerialFlashBackend before calling beginWork().
+#ifndef CUSTOFLASH_HOST_SPI_H
+#define CUSTOFLASH_HOST_SPI_H
+
+#include "Arduino.h"
+
+#define MSBFIRST  1
+#define SPI_MODE0 0
+
+class SPISettings {
+public:
+  SPISettings(uint32_t clock = 4000000, uint8_t bitOrder = MSBFIRST, uint8_t dataMode = SPI_MODE0) {}
+};
+
+class SPIClass {
+public:
+  void begin() {}
+  void beginTransaction(SPISettings settings) {}
+  void endTransaction() {}
+  uint8_t transfer(uint8_t data) { return 0; }
+  uint16_t transfer16(uint16_t data) { return 0; }
+  void transfer(void *buf, size_t count) { memset(buf, 0, count); }
+};
+
+extern SPIClass SPI;
+extern SPIClass SPI1;
+
+#endif
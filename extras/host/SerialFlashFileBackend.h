@@ -0,0 +1,68 @@
+// Flash chip emulated in an image file mapped into memory, so the contents
+// survive between runs. A new or short file is extended with blank bytes.
+#ifndef INCLUDE_SERIAL_FLASH_FILE_BACKEND
+#define INCLUDE_SERIAL_FLASH_FILE_BACKEND
+
+#include "SerialFlashMemoryBackend.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class SerialFlashFileBackend : public SerialFlashMemoryBackend
+{
+public:
+	SerialFlashFileBackend(const char *path, uint32_t size = 2097152) {
+		fd = open(path, O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			return;
+		}
+
+		struct stat st;
+		fstat(fd, &st);
+		if ((uint32_t) st.st_size < size) {
+			uint8_t blank[4096];
+			memset(blank, 0xFF, sizeof(blank));
+			lseek(fd, st.st_size, SEEK_SET);
+			for (uint32_t left = size - st.st_size; left > 0; ) {
+				uint32_t n = left < sizeof(blank) ? left : sizeof(blank);
+				if (::write(fd, blank, n) != (ssize_t) n) {
+					close(fd);
+					fd = -1;
+					return;
+				}
+				left -= n;
+			}
+		}
+
+		void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			fd = -1;
+			return;
+		}
+		memory = (uint8_t *) map;
+		memorySize = size;
+	}
+
+	~SerialFlashFileBackend() {
+		if (memory != NULL) {
+			msync(memory, memorySize, MS_SYNC);
+			munmap(memory, memorySize);
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+
+	bool isOpen() { return memory != NULL; }
+
+	void sleep() {
+		msync(memory, memorySize, MS_ASYNC);
+	}
+
+private:
+	int fd = -1;
+};
+
+#endif
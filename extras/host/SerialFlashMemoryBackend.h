@@ -0,0 +1,100 @@
+// NOR flash emulation over a block of memory, shared by the RAM and image
+// file backends. Counts every operation so host runs can be compared.
+#ifndef INCLUDE_SERIAL_FLASH_MEMORY_BACKEND
+#define INCLUDE_SERIAL_FLASH_MEMORY_BACKEND
+
+#include "SerialFlashBackend.h"
+#include <string.h>
+
+typedef struct SerialFlashBackendStats {
+	uint32_t reads;           // read commands
+	uint32_t bytesRead;
+	uint32_t programs;        // 256 byte page programs
+	uint32_t bytesWritten;
+	uint32_t lostBits;        // 1 bits that a program could not set
+	uint32_t sectorErases;
+	uint32_t blockErases;
+	uint32_t chipErases;
+} SerialFlashBackendStats_t;
+
+class SerialFlashMemoryBackend : public SerialFlashBackend
+{
+public:
+	SerialFlashBackendStats_t stats;
+
+	uint32_t size() { return memorySize; }
+	uint8_t *data() { return memory; }
+	void resetStats() { memset(&stats, 0, sizeof(stats)); }
+
+	void readID(uint8_t *buf) {
+		//Winbond ID, capacity() decodes the size from the last byte
+		uint8_t bits = 0;
+		while ((1ul << bits) < memorySize) {
+			bits++;
+		}
+		buf[0] = 0xEF;
+		buf[1] = 0x40;
+		buf[2] = bits;
+	}
+
+	void read(uint32_t addr, void *buf, uint32_t len) {
+		uint8_t *p = (uint8_t *) buf;
+		stats.reads++;
+		stats.bytesRead += len;
+		for (uint32_t i = 0; i < len; i++) {
+			p[i] = memory[(addr + i) % memorySize];
+		}
+	}
+
+	void write(uint32_t addr, const void *buf, uint32_t len) {
+		//programming can only clear bits, one page at a time
+		const uint8_t *p = (const uint8_t *) buf;
+		stats.bytesWritten += len;
+		for (uint32_t i = 0; i < len; i++) {
+			if (i == 0 || ((addr + i) & 0xFF) == 0) {
+				stats.programs++;
+			}
+			uint8_t *cell = &memory[(addr + i) % memorySize];
+			stats.lostBits += countBits(p[i] & ~*cell);
+			*cell &= p[i];
+		}
+	}
+
+	void eraseSector(uint32_t addr) {
+		stats.sectorErases++;
+		erase(addr, 4096);
+	}
+
+	void eraseBlock(uint32_t addr) {
+		stats.blockErases++;
+		erase(addr, 65536);
+	}
+
+	void eraseAll() {
+		stats.chipErases++;
+		memset(memory, 0xFF, memorySize);
+	}
+
+protected:
+	uint8_t *memory = NULL;
+	uint32_t memorySize = 0;
+
+	SerialFlashMemoryBackend() {
+		resetStats();
+	}
+
+	void erase(uint32_t addr, uint32_t length) {
+		uint32_t start = (addr % memorySize) & ~(length - 1);
+		memset(memory + start, 0xFF, length);
+	}
+
+	static uint8_t countBits(uint8_t x) {
+		uint8_t n = 0;
+		for (; x; x &= x - 1) {
+			n++;
+		}
+		return n;
+	}
+};
+
+#endif
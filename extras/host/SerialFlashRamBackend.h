@@ -0,0 +1,22 @@
+// Flash chip emulated in a RAM array, blank at start.
+#ifndef INCLUDE_SERIAL_FLASH_RAM_BACKEND
+#define INCLUDE_SERIAL_FLASH_RAM_BACKEND
+
+#include "SerialFlashMemoryBackend.h"
+#include <stdlib.h>
+
+class SerialFlashRamBackend : public SerialFlashMemoryBackend
+{
+public:
+	SerialFlashRamBackend(uint32_t size = 2097152) {
+		memory = (uint8_t *) malloc(size);
+		memorySize = size;
+		memset(memory, 0xFF, size);
+	}
+
+	~SerialFlashRamBackend() {
+		free(memory);
+	}
+};
+
+#endif
@@ -0,0 +1,153 @@
+// RAM flash emulation that also charges the time a real chip would take,
+// on a simulated clock. Programs and erases run in the background like on
+// the chip: the next operation waits for them, while reads (and programs
+// outside the area being erased) suspend them, as SerialFlashChip does.
+#ifndef INCLUDE_SERIAL_FLASH_TIMED_BACKEND
+#define INCLUDE_SERIAL_FLASH_TIMED_BACKEND
+
+#include "SerialFlashRamBackend.h"
+
+// Timings in nanoseconds, defaults are the W25Q16JV typical values
+typedef struct SerialFlashCostModel {
+	uint32_t spiClock = 12000000;     // SPI bits per second
+	uint32_t readHeader = 5;          // command, address and dummy bytes of a read
+	uint32_t programHeader = 5;       // write enable, command and address of a program
+	uint32_t eraseHeader = 5;         // write enable, command and address of an erase
+	uint32_t statusPoll = 2;          // bytes per busy check
+	uint64_t tPP = 400000;            // page program
+	uint64_t tSE = 45000000;          // 4 kB sector erase
+	uint64_t tBE = 150000000;         // 64 kB block erase
+	uint64_t tCE = 5000000000ULL;     // chip erase
+	uint64_t tSUS = 20000;            // suspend latency
+	uint64_t tRES = 20000;            // resume, time before the next suspend
+} SerialFlashCostModel_t;
+
+class SerialFlashTimedBackend : public SerialFlashRamBackend
+{
+public:
+	SerialFlashCostModel_t cost;
+	uint64_t now = 0;           // simulated time
+	uint64_t spiBytes = 0;
+	uint32_t suspends = 0;
+
+	SerialFlashTimedBackend(uint32_t size = 2097152) : SerialFlashRamBackend(size) {}
+
+	void read(uint32_t addr, void *buf, uint32_t len) {
+		if (!busyErase) {
+			waitBusy();   // programs are not suspended
+		}
+		suspendFor(spiTime(cost.readHeader + len));
+		SerialFlashMemoryBackend::read(addr, buf, len);
+	}
+
+	void write(uint32_t addr, const void *buf, uint32_t len) {
+		//one program per page, each waits for the previous one
+		bool suspended = busyErase && (addr >= eraseEnd || addr + len <= eraseStart) && now < busyUntil;
+		uint64_t eraseLeft = 0;
+		if (suspended) {
+			now += cost.tSUS;
+			suspends++;
+			eraseLeft = busyUntil - now;
+		} else {
+			waitBusy();
+		}
+
+		const uint8_t *p = (const uint8_t *) buf;
+		while (len > 0) {
+			uint32_t max = 256 - (addr & 0xFF);
+			uint32_t pagelen = len <= max ? len : max;
+			if (now < busyUntil && !suspended) {
+				waitBusy();
+			}
+			now += spiTime(cost.programHeader + pagelen);
+			SerialFlashMemoryBackend::write(addr, p, pagelen);
+			busyUntil = now + cost.tPP;
+			if (suspended) {
+				now = busyUntil;  // the driver waits for programs made during a suspend
+			}
+			addr += pagelen;
+			p += pagelen;
+			len -= pagelen;
+		}
+
+		if (suspended) {
+			now += cost.tRES;
+			busyUntil = now + eraseLeft;
+		} else {
+			busyErase = false;
+		}
+	}
+
+	void eraseSector(uint32_t addr) {
+		startErase(addr, 4096, cost.tSE);
+		SerialFlashMemoryBackend::eraseSector(addr);
+	}
+
+	void eraseBlock(uint32_t addr) {
+		startErase(addr, 65536, cost.tBE);
+		SerialFlashMemoryBackend::eraseBlock(addr);
+	}
+
+	void eraseAll() {
+		startErase(0, memorySize, cost.tCE);
+		SerialFlashMemoryBackend::eraseAll();
+	}
+
+	bool ready() {
+		spiBytes += cost.statusPoll;
+		now += spiTime(cost.statusPoll);
+		return now >= busyUntil;
+	}
+
+	void sleep() {
+		waitBusy();
+	}
+
+	void readID(uint8_t *buf) {
+		waitBusy();
+		SerialFlashMemoryBackend::readID(buf);
+	}
+
+	// time until a running program or erase is finished
+	void waitBusy() {
+		if (now < busyUntil) {
+			spiBytes += cost.statusPoll;
+			now = busyUntil;
+		}
+		busyErase = false;
+	}
+
+private:
+	uint64_t busyUntil = 0;
+	bool busyErase = false;
+	uint32_t eraseStart = 0;
+	uint32_t eraseEnd = 0;
+
+	uint64_t spiTime(uint32_t bytes) {
+		spiBytes += bytes;
+		return (uint64_t) bytes * 8 * 1000000000ULL / cost.spiClock;
+	}
+
+	void suspendFor(uint64_t duration) {
+		//reads suspend erases, which then take that much longer
+		if (now < busyUntil) {
+			suspends++;
+			uint64_t left = busyUntil - now;
+			now += cost.tSUS + duration + cost.tRES;
+			busyUntil = now + left;
+		} else {
+			now += duration;
+		}
+	}
+
+	void startErase(uint32_t addr, uint32_t length, uint64_t duration) {
+		waitBusy();
+		now += spiTime(cost.eraseHeader);
+		busyUntil = now + duration;
+		busyErase = true;
+		eraseStart = addr & ~(length - 1);
+		eraseEnd = eraseStart + length;
+	}
+};
+
+#endif
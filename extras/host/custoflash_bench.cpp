@@ -0,0 +1,136 @@
+// Benchmarks CustoFlash against a simulated W25Q16JV and reports, per
+// operation, the simulated time, SPI bytes, page programs and erases.
+// Build the same file against two trees to compare a change to a baseline.
+//
+// Build from the repository root:
+//   g++ -std=gnu++11 -O2 -Iextras/host -Isrc -o custoflash_bench src/*.cpp src/util/*.cpp
+//       extras/host/HostCompat.cpp extras/host/custoflash_bench.cpp
+//
+// Usage: ./custoflash_bench [sectors to write per record size] [sample period in us]
+#include "CustoFlash.h"
+#include "SerialFlashTimedBackend.h"
+
+typedef struct Sample {
+  uint64_t time;
+  uint64_t spiBytes;
+  uint32_t programs;
+  uint32_t erases;
+} Sample_t;
+
+typedef struct Result {
+  uint32_t ops = 0;
+  Sample_t total = {0, 0, 0, 0};
+  uint64_t worst = 0;
+} Result_t;
+
+static SerialFlashTimedBackend *flash = NULL;
+
+static Sample_t sample() {
+  Sample_t s;
+  s.time = flash->now;
+  s.spiBytes = flash->spiBytes;
+  s.programs = flash->stats.programs;
+  s.erases = flash->stats.sectorErases + flash->stats.blockErases + flash->stats.chipErases;
+  return s;
+}
+
+static void add(Result_t &result, const Sample_t &before) {
+  Sample_t after = sample();
+  uint64_t time = after.time - before.time;
+  result.ops++;
+  result.total.time += time;
+  result.total.spiBytes += after.spiBytes - before.spiBytes;
+  result.total.programs += after.programs - before.programs;
+  result.total.erases += after.erases - before.erases;
+  if (time > result.worst) {
+    result.worst = time;
+  }
+}
+
+static void report(const char *name, const Result_t &result) {
+  double ops = result.ops ? result.ops : 1;
+  printf("%-16s %9u %12.1f %12.1f %10.1f %9.3f %9.4f\n", name, result.ops,
+    result.total.time / ops / 1000.0, result.worst / 1000.0,
+    result.total.spiBytes / ops, result.total.programs / ops, result.total.erases / ops);
+}
+
+static void freshFlash() {
+  if (flash != NULL) {
+    SerialFlashChip::setBackend(NULL);
+    delete flash;
+  }
+  flash = new SerialFlashTimedBackend();
+  SerialFlashChip::setBackend(flash);
+  SerialFlashLayout::invalidateSectorTable();
+  CustoFlash.beginWork();
+}
+
+static uint16_t capacity(uint8_t recordSize) {
+  return serialFlashCapacity(SECTOR_SIZE, recordSize);
+}
+
+static void fill(uint8_t recordSize, uint32_t records, uint32_t period, Result_t &writes, Result_t &rollovers) {
+  uint8_t record[MAX_PAYLOAD_SIZE];
+  for (uint32_t n = 0; n < records; n++) {
+    memset(record, n, recordSize);
+    Sample_t before = sample();
+    RecordAddress_t written = CustoFlash.writeRecord(record, recordSize);
+    add(writes, before);
+    if (written.recordIndex == capacity(recordSize) - 1) {
+      add(rollovers, before);     // the sector filled up, the next one was activated
+    }
+    flash->now += (uint64_t) period * 1000;
+  }
+}
+
+int main(int argc, char **argv) {
+  uint32_t sectors = argc > 1 ? strtoul(argv[1], NULL, 10) : 600;
+  uint32_t period = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+  const uint8_t sizes[] = {4, 12, 32, 64, 128, 242};
+
+  printf("%-16s %9s %12s %12s %10s %9s %9s\n", "operation", "ops", "us/op", "worst us", "SPI B/op", "prog/op", "erase/op");
+  for (uint8_t j = 0; j < sizeof(sizes); j++) {
+    uint8_t s = sizes[j];
+    Result_t writes, rollovers;
+    freshFlash();
+    fill(s, sectors * capacity(s), period, writes, rollovers);
+
+    char name[32];
+    snprintf(name, sizeof(name), "write %u B", s);
+    report(name, writes);
+    snprintf(name, sizeof(name), "rollover %u B", s);
+    report(name, rollovers);
+  }
+
+  //mount and drain a flash holding a full ring of 12 byte records
+  Result_t writes, rollovers, mount, drain;
+  freshFlash();
+  fill(12, SerialFlashLayout::getStreamSectors() * capacity(12), 0, writes, rollovers);
+  CustoFlash.endWork();
+  SerialFlashLayout::invalidateSectorTable();
+  Sample_t before = sample();
+  CustoFlash.beginWork();
+  add(mount, before);
+  report("mount", mount);
+
+  RecordAddress_t addresses[64];
+  uint8_t payload[51];
+  uint32_t drained = 0;
+  for (;;) {
+    before = sample();
+    uint16_t count = CustoFlash.retrieveLatestBacklogsAddresses(sizeof(payload), addresses);
+    if (count == 0) {
+      break;
+    }
+    CustoFlash.readRecords(addresses, count, payload);
+    CustoFlash.markRecordsSent(addresses, count);
+    add(drain, before);
+    drained += count;
+  }
+  report("drain batch", drain);
+  printf("%u records drained, %u suspends, %.3f s simulated\n", drained, flash->suspends, flash->now / 1e9);
+
+  SerialFlashChip::setBackend(NULL);
+  delete flash;
+  return 0;
+}
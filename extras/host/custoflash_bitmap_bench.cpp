@@ -0,0 +1,188 @@
+// Checks the word-wide bitmap scans of SerialFlashBitmap against the byte at
+// a time LogTable256 scans they replaced, then times both on bitmaps the
+// size of a sector of 1 byte records (410 bytes) and of 12 byte records
+// (42 bytes), from all unsent to a single unsent record.
+//
+// Build from the repository root:
+//   g++ -std=gnu++11 -O2 -Iextras/host -Isrc -o custoflash_bitmap_bench src/util/SerialFlash_bitmap.cpp
+//       extras/host/custoflash_bitmap_bench.cpp
+//
+// Usage: ./custoflash_bitmap_bench [rounds]
+// Exits with 1 when the two implementations disagree.
+#include "util/SerialFlash_bitmap.h"
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The byte scans as they were in SerialFlashLayout
+static const char LogTable256[256] =
+{
+  #define LT(n) n, n, n, n, n, n, n, n, n, n, n, n, n, n, n, n
+  0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
+  LT(4), LT(5), LT(5), LT(6), LT(6), LT(6), LT(6),
+  LT(7), LT(7), LT(7), LT(7), LT(7), LT(7), LT(7), LT(7)
+};
+
+static uint16_t ctz(uint8_t x) {
+  return x == 0 ? 8 : (uint16_t) LogTable256[x & (int8_t)(-x)];
+}
+
+static uint16_t clz(uint8_t x) {
+  return x == 0 ? 8 : (uint16_t) 7 - LogTable256[x];
+}
+
+static uint16_t countTrailingZeroes(uint8_t* positionBytes, uint32_t length) {
+  uint8_t* ptr;
+  uint16_t i = 0;
+  for (ptr = positionBytes; i < length - 1 && *ptr == 0x00; ptr++, i++);
+  return i * 8 + ctz(*ptr);
+}
+
+static uint16_t countLeadingZeroes(uint8_t* positionBytes, uint32_t length) {
+  uint8_t* ptr;
+  uint16_t i = 0;
+  for (ptr = (positionBytes + length - 1); *ptr == 0x00 && i < length - 1; ptr--, i++);
+  return i * 8 + clz(*ptr);
+}
+
+static uint16_t countSetBits(uint8_t* positionBytes, uint32_t length) {
+  uint16_t count = 0;
+  for (uint32_t i = 0; i < length; i++) {
+    for (uint8_t x = positionBytes[i]; x != 0; x &= x - 1, count++);
+  }
+  return count;
+}
+
+// nextLatestBacklogIndex() before: mask the bits at and after preceding,
+// then count the leading zeroes
+static uint16_t byteLastSetBefore(uint8_t *bits, uint16_t preceding) {
+  uint16_t length = (preceding + 7) / 8;
+  uint8_t saved = bits[length - 1];
+  uint8_t remainderBits = preceding % 8;
+  uint8_t unusedBits = remainderBits == 0 ? 0 : 8 - remainderBits;
+  if (remainderBits != 0) {
+    bits[length - 1] &= ~((0xFF << remainderBits) & 0xFF);
+  }
+  uint16_t pos = preceding - (countLeadingZeroes(bits, length) - unusedBits) - 1;
+  bits[length - 1] = saved;
+  return pos;
+}
+
+typedef struct Case {
+  const char *name;
+  uint16_t length;      // bitmap bytes
+  uint32_t density;     // one set bit in density
+} Case_t;
+
+static uint32_t mismatches = 0;
+
+static void fill(uint8_t *bits, uint16_t length, uint32_t density, std::mt19937 &rng) {
+  memset(bits, 0, length);
+  for (uint16_t n = 0; n < length * 8; n++) {
+    if (rng() % density == 0) {
+      bits[n / 8] |= 1 << (n % 8);
+    }
+  }
+}
+
+static void check(uint8_t *bits, uint16_t length, std::mt19937 &rng) {
+  uint16_t total = length * 8;
+  uint16_t byteFirst = countTrailingZeroes(bits, length);
+  if (SerialFlashBitmap::findFirstSet(bits, 0, total) != byteFirst) {
+    mismatches++;
+  }
+  if (SerialFlashBitmap::countSet(bits, 0, total) != countSetBits(bits, length)) {
+    mismatches++;
+  }
+  for (int t = 0; t < 8; t++) {
+    uint16_t pos = 1 + rng() % total;
+    if (SerialFlashBitmap::findLastSetBefore(bits, pos) != byteLastSetBefore(bits, pos)) {
+      mismatches++;
+    }
+    //against a bit by bit scan for arbitrary ranges
+    uint16_t from = rng() % total;
+    uint16_t end = from + rng() % (total - from + 1);
+    uint16_t first = end, last = SERIALFLASH_NO_BIT, count = 0;
+    for (uint16_t n = from; n < end; n++) {
+      if (bits[n / 8] & (1 << (n % 8))) {
+        first = first == end ? n : first;
+        last = n;
+        count++;
+      }
+    }
+    if (SerialFlashBitmap::findFirstSet(bits, from, end) != first
+      || SerialFlashBitmap::findLastSet(bits, from, end) != last
+      || SerialFlashBitmap::countSet(bits, from, end) != count) {
+      mismatches++;
+    }
+    uint8_t cleared[512];
+    memcpy(cleared, bits, length);
+    SerialFlashBitmap::clearRange(cleared, from, end);
+    for (uint16_t n = 0; n < total; n++) {
+      bool set = cleared[n / 8] & (1 << (n % 8));
+      bool expected = (n < from || n >= end) && (bits[n / 8] & (1 << (n % 8)));
+      if (set != expected) {
+        mismatches++;
+        break;
+      }
+    }
+  }
+}
+
+template <typename F>
+static double nanosPerCall(uint32_t rounds, F f) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  volatile uint32_t sink = 0;
+  for (uint32_t r = 0; r < rounds; r++) {
+    sink = sink + f(r);
+  }
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / rounds;
+}
+
+int main(int argc, char **argv) {
+  uint32_t rounds = argc > 1 ? atoi(argv[1]) : 200000;
+  static const Case_t cases[] = {
+    { "1 byte, all set", 410, 1 },
+    { "1 byte, 1 in 64", 410, 64 },
+    { "1 byte, 1 in 2048", 410, 2048 },
+    { "1 byte, one set", 410, 0 },
+    { "12 byte, all set", 42, 1 },
+    { "12 byte, 1 in 64", 42, 64 },
+    { "12 byte, one set", 42, 0 },
+  };
+  std::mt19937 rng(1);
+  uint32_t words[128];
+  uint8_t *bits = (uint8_t *) words + 1;    // stack buffers are not word aligned
+
+  for (int t = 0; t < 2000; t++) {
+    uint16_t length = 1 + rng() % 410;
+    fill(bits, length, 1 + rng() % 512, rng);
+    check(bits, length, rng);
+  }
+
+  printf("%-20s %26s %26s %26s\n", "bitmap", "first set (byte/word ns)", "last set before end", "count set");
+  for (const Case_t &c : cases) {
+    if (c.density == 0) {
+      memset(bits, 0, c.length);
+      bits[0] = 0x01;     // the earliest record is the only one left
+    } else {
+      fill(bits, c.length, c.density, rng);
+    }
+    check(bits, c.length, rng);
+    uint16_t total = c.length * 8;
+    double byteFirst = nanosPerCall(rounds, [&](uint32_t) { return countTrailingZeroes(bits, c.length); });
+    double wordFirst = nanosPerCall(rounds, [&](uint32_t) { return SerialFlashBitmap::findFirstSet(bits, 0, total); });
+    double byteLast = nanosPerCall(rounds, [&](uint32_t) { return byteLastSetBefore(bits, total); });
+    double wordLast = nanosPerCall(rounds, [&](uint32_t) { return SerialFlashBitmap::findLastSetBefore(bits, total); });
+    double byteCount = nanosPerCall(rounds, [&](uint32_t) { return countSetBits(bits, c.length); });
+    double wordCount = nanosPerCall(rounds, [&](uint32_t) { return SerialFlashBitmap::countSet(bits, 0, total); });
+    printf("%-20s %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f\n", c.name,
+      byteFirst, wordFirst, byteLast, wordLast, byteCount, wordCount);
+  }
+
+  printf("%u mismatches\n", mismatches);
+  return mismatches > 0 ? 1 : 0;
+}
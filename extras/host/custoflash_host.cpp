@@ -0,0 +1,63 @@
+// Runs CustoFlash on a host computer against an emulated flash chip and
+// prints the flash operations it took.
+//
+// Build from the repository root:
+//   g++ -std=gnu++11 -O2 -Iextras/host -Isrc -o custoflash_host src/*.cpp src/util/*.cpp
+//       extras/host/HostCompat.cpp extras/host/custoflash_host.cpp
+//
+// Usage: ./custoflash_host [image file] [records]
+// Without an image file the flash is kept in RAM and starts blank.
+#include "CustoFlash.h"
+#include "SerialFlashRamBackend.h"
+#include "SerialFlashFileBackend.h"
+
+static void printStats(SerialFlashBackendStats_t &stats) {
+  printf("reads %u (%u bytes), programs %u (%u bytes), erases %u, lost bits %u\n",
+    stats.reads, stats.bytesRead, stats.programs, stats.bytesWritten,
+    stats.sectorErases + stats.blockErases + stats.chipErases, stats.lostBits);
+}
+
+int main(int argc, char **argv) {
+  SerialFlashMemoryBackend *flash;
+  if (argc > 1 && strcmp(argv[1], "-") != 0) {
+    SerialFlashFileBackend *file = new SerialFlashFileBackend(argv[1]);
+    if (!file->isOpen()) {
+      fprintf(stderr, "cannot open %s\n", argv[1]);
+      return 1;
+    }
+    flash = file;
+  } else {
+    flash = new SerialFlashRamBackend();
+  }
+  uint32_t records = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000;
+
+  SerialFlashChip::setBackend(flash);
+  CustoFlash.beginWork();
+  printf("mount: ");
+  printStats(flash->stats);
+
+  //log sensor samples, acknowledging a LoRa sized batch every 16 records
+  flash->resetStats();
+  uint8_t sample[12];
+  for (uint32_t n = 0; n < records; n++) {
+    for (uint8_t j = 0; j < sizeof(sample); j++) {
+      sample[j] = n + j;
+    }
+    CustoFlash.writeRecord(sample, sizeof(sample));
+
+    if (n % 16 == 15) {
+      RecordAddress_t addresses[64];
+      uint16_t count = CustoFlash.retrieveLatestBacklogsAddresses(51, addresses);
+      uint8_t payload[51];
+      CustoFlash.readRecords(addresses, count, payload);
+      CustoFlash.markRecordsSent(addresses, count);
+    }
+  }
+  CustoFlash.endWork();
+  printf("%u records: ", records);
+  printStats(flash->stats);
+
+  SerialFlashChip::setBackend(NULL);
+  delete flash;
+  return 0;
+}
@@ -0,0 +1,338 @@
+// Replays a trace printed by CustoFlash.dumpTrace() (see SERIALFLASH_TRACE)
+// against an emulated chip. Every call must return what it returned on the
+// device, and the device latencies are compared with the simulated ones.
+//
+// Build from the repository root:
+//   g++ -std=gnu++11 -O2 -Iextras/host -Isrc -o custoflash_replay src/*.cpp src/util/*.cpp
+//       extras/host/HostCompat.cpp extras/host/custoflash_replay.cpp
+//
+// Usage: ./custoflash_replay <trace file> [image file]
+// The image holds the flash contents when the trace started, without it the
+// flash starts blank. Lines not starting with "T " are ignored, so a whole
+// serial capture can be given. Exits with 1 when a return value differs.
+// Address entries whose call was overwritten in the ring, and calls that
+// logged fewer addresses than they took (see SERIALFLASH_TRACE_ADDRESS_RUNS),
+// are counted and reported, the latter are replayed with the logged ones.
+#include "CustoFlash.h"
+#include "SerialFlashTimedBackend.h"
+#include <vector>
+
+static const char *opNames[SERIALFLASH_TRACE_OP_COUNT] = {
+  "beginWork", "endWork", "writeRecord", "readRecord", "readRecords",
+  "markRecordSent", "markRecordsSent", "markRangeSent",
+  "markLatestWrittenRecordSent", "getLatestWrittenRecordSector",
+  "getLatestWrittenRecordIndex", "getEarliestBacklogSector",
+  "getEarliestBacklogIndex", "getLatestBacklogSector", "getLatestBacklogIndex",
+  "getLatestBacklogIndex2", "retrieveLatestBacklogsAddresses",
+  "getNextRecordIndexForSector", "getNextBacklogAddress", "read", "write",
+  "writeAsync", "eraseAll", "eraseBlock", "eraseSector", "address",
+  "retrievePackedBacklogsAddresses"
+};
+
+typedef struct OpStats {
+  uint32_t calls;
+  uint64_t deviceTotal;
+  uint32_t deviceMax;
+  uint64_t replayTotal;
+  uint32_t replayMax;
+} OpStats_t;
+
+static RecordAddress_t unpackAddress(uint32_t packed) {
+  RecordAddress_t address;
+  address.sectorIndex = packed >> 16;
+  address.recordIndex = packed & 0xFFFF;
+  return address;
+}
+
+static uint32_t packAddress(RecordAddress_t address) {
+  return ((uint32_t) address.sectorIndex << 16) | address.recordIndex;
+}
+
+// Record addresses a call took, from its own entry
+static uint32_t expectedAddresses(const SerialFlashTraceEntry_t &e) {
+  switch (e.op) {
+  case SERIALFLASH_TRACE_READ_RECORDS:
+  case SERIALFLASH_TRACE_MARK_RECORDS_SENT:
+    return e.arg;
+  case SERIALFLASH_TRACE_RETRIEVE_BACKLOGS:
+  case SERIALFLASH_TRACE_RETRIEVE_PACKED:
+    return e.value;
+  case SERIALFLASH_TRACE_MARK_RANGE_SENT:
+    return 1;
+  case SERIALFLASH_TRACE_NEXT_BACKLOG_ADDRESS:
+    return e.value == NO_BACKLOG_RECORD ? 0 : 1;
+  default:
+    return 0;
+  }
+}
+
+static bool loadTrace(const char *path, std::vector<SerialFlashTraceEntry_t> &trace) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return false;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    unsigned int time, elapsed, op, size, arg, value, stream = 0;
+    if (strncmp(line, "T ", 2) != 0
+      || sscanf(line + 2, "%x %x %x %x %x %x %x", &time, &elapsed, &op, &size, &arg, &value, &stream) < 6
+      || op >= SERIALFLASH_TRACE_OP_COUNT) {
+      continue;
+    }
+    SerialFlashTraceEntry_t e;
+    e.time = time;
+    e.elapsed = elapsed;
+    e.op = op;
+    e.size = size;
+    e.arg = arg;
+    e.value = value;
+    e.stream = stream;
+    trace.push_back(e);
+  }
+  fclose(f);
+  return true;
+}
+
+static bool loadImage(const char *path, SerialFlashMemoryBackend *flash) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  size_t n = fread(flash->data(), 1, flash->size(), f);
+  fclose(f);
+  return n > 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <trace file> [image file]\n", argv[0]);
+    return 2;
+  }
+  std::vector<SerialFlashTraceEntry_t> trace;
+  if (!loadTrace(argv[1], trace)) {
+    fprintf(stderr, "cannot read %s\n", argv[1]);
+    return 2;
+  }
+  SerialFlashTimedBackend *flash = new SerialFlashTimedBackend();
+  if (argc > 2 && !loadImage(argv[2], flash)) {
+    fprintf(stderr, "cannot read %s\n", argv[2]);
+    return 2;
+  }
+  SerialFlashChip::setBackend(flash);
+
+  OpStats_t stats[SERIALFLASH_TRACE_OP_COUNT];
+  memset(stats, 0, sizeof(stats));
+  uint32_t mismatches = 0;
+  uint32_t calls = 0;
+  uint32_t lastEnd = 0;         // device time at the end of the previous call
+  uint32_t orphans = 0;         // address entries of calls overwritten in the ring
+  uint32_t truncated = 0;       // calls that logged fewer addresses than they took
+  bool mounted = false;
+  std::vector<uint8_t> buf;
+  std::vector<RecordAddress_t> addresses;
+  std::vector<RecordAddress_t> returned;
+
+  for (size_t p = 0; p < trace.size(); ) {
+    const SerialFlashTraceEntry_t &e = trace[p++];
+    addresses.clear();
+    uint32_t entries = 0;
+    while (p < trace.size() && trace[p].op == SERIALFLASH_TRACE_ADDRESS) {
+      //a run of record indexes, traces before runs have a value of 0
+      const SerialFlashTraceEntry_t &a = trace[p++];
+      RecordAddress_t address = unpackAddress(a.arg);
+      for (uint32_t n = 0; n < (a.value > 0 ? a.value : 1); n++) {
+        addresses.push_back(address);
+        address.recordIndex += a.size ? -1 : 1;
+      }
+      entries++;
+    }
+    if (e.op == SERIALFLASH_TRACE_ADDRESS) {
+      orphans += entries + 1;
+      continue;
+    }
+    bool complete = addresses.size() >= expectedAddresses(e);
+    if (!complete) {
+      if (truncated < 20) {
+        printf("call %u %s(%x): %u of %u addresses logged\n", calls + 1, opNames[e.op], e.arg,
+          (unsigned) addresses.size(), expectedAddresses(e));
+      }
+      truncated++;
+    }
+
+    //the trace may start after beginWork(), mount like the device did
+    if (!mounted && e.op != SERIALFLASH_TRACE_BEGIN_WORK) {
+      CustoFlash.beginWork();
+    }
+    mounted = true;
+
+    //the chip keeps erasing and programming while the device does other things
+    int32_t idle = (int32_t) (e.time - lastEnd);
+    if (calls > 0 && idle > 0) {
+      flash->now += (uint64_t) idle * 1000;
+    }
+    calls++;
+
+    uint64_t start = flash->now;
+    uint32_t value = e.value;
+    returned.clear();
+    RecordAddress_t address = unpackAddress(e.arg);
+    CustoFlashStream &log = CustoFlash.stream(e.stream);
+    switch (e.op) {
+    case SERIALFLASH_TRACE_BEGIN_WORK:
+      CustoFlash.beginWork();
+      break;
+    case SERIALFLASH_TRACE_END_WORK:
+      CustoFlash.endWork();
+      break;
+    case SERIALFLASH_TRACE_WRITE_RECORD:
+      //only the first bytes are traced, they are repeated over the record
+      buf.resize(e.size + 4);
+      for (uint16_t n = 0; n < e.size; n++) {
+        buf[n] = e.arg >> (8 * (n % 4));
+      }
+      value = packAddress(log.writeRecord(buf.data(), e.size));
+      break;
+    case SERIALFLASH_TRACE_READ_RECORD:
+      buf.resize(256);
+      value = log.readRecord(address, buf.data());
+      break;
+    case SERIALFLASH_TRACE_READ_RECORDS:
+      buf.resize(256 * addresses.size() + 1);
+      value = log.readRecords(addresses.data(), addresses.size(), buf.data());
+      break;
+    case SERIALFLASH_TRACE_MARK_RECORD_SENT:
+      log.markRecordSent(address);
+      break;
+    case SERIALFLASH_TRACE_MARK_RECORDS_SENT:
+      log.markRecordsSent(addresses.data(), addresses.size());
+      break;
+    case SERIALFLASH_TRACE_MARK_RANGE_SENT:
+      if (!addresses.empty()) {
+        log.markRangeSent(address, addresses[0]);
+      }
+      break;
+    case SERIALFLASH_TRACE_MARK_LATEST_SENT:
+      log.markLatestWrittenRecordSent();
+      break;
+    case SERIALFLASH_TRACE_LATEST_WRITTEN_SECTOR:
+      value = log.getLatestWrittenRecordSector();
+      break;
+    case SERIALFLASH_TRACE_LATEST_WRITTEN_INDEX:
+      value = log.getLatestWrittenRecordIndex(e.arg);
+      break;
+    case SERIALFLASH_TRACE_EARLIEST_BACKLOG_SECTOR:
+      value = log.getEarliestBacklogSector();
+      break;
+    case SERIALFLASH_TRACE_EARLIEST_BACKLOG_INDEX:
+      value = log.getEarliestBacklogIndex(e.arg);
+      break;
+    case SERIALFLASH_TRACE_LATEST_BACKLOG_SECTOR:
+      value = log.getLatestBacklogSector();
+      break;
+    case SERIALFLASH_TRACE_LATEST_BACKLOG_INDEX:
+      value = log.getLatestBacklogIndex(e.arg);
+      break;
+    case SERIALFLASH_TRACE_LATEST_BACKLOG_BEFORE:
+      value = log.getLatestBacklogIndex(address.sectorIndex, address.recordIndex);
+      break;
+    case SERIALFLASH_TRACE_RETRIEVE_BACKLOGS:
+      returned.resize(MAX_PAYLOAD_SIZE + 1);
+      value = log.retrieveLatestBacklogsAddresses(e.size, returned.data());
+      returned.resize(value);
+      break;
+    case SERIALFLASH_TRACE_RETRIEVE_PACKED:
+      returned.resize(MAX_PAYLOAD_SIZE + 1);
+      value = log.retrievePackedBacklogsAddresses(e.size, returned.data(), NULL);
+      returned.resize(value);
+      break;
+    case SERIALFLASH_TRACE_NEXT_RECORD_INDEX:
+      value = log.getNextRecordIndexForSector(e.arg);
+      break;
+    case SERIALFLASH_TRACE_NEXT_BACKLOG_ADDRESS:
+      returned.resize(1);
+      value = log.getNextBacklogAddress(returned.data());
+      if (value == NO_BACKLOG_RECORD) {
+        returned.clear();
+      }
+      break;
+    case SERIALFLASH_TRACE_READ:
+      buf.resize(e.value + 1);
+      CustoFlash.read(e.arg, buf.data(), e.value);
+      break;
+    case SERIALFLASH_TRACE_WRITE:
+    case SERIALFLASH_TRACE_WRITE_ASYNC:
+      //the data is not traced, zeros are written instead
+      buf.assign(e.value + 1, 0);
+      if (e.op == SERIALFLASH_TRACE_WRITE) {
+        CustoFlash.write(e.arg, buf.data(), e.value);
+      } else {
+        CustoFlash.writeAsync(e.arg, buf.data(), e.value);
+      }
+      break;
+    case SERIALFLASH_TRACE_ERASE_ALL:
+      CustoFlash.eraseAll();
+      break;
+    case SERIALFLASH_TRACE_ERASE_BLOCK:
+      CustoFlash.eraseBlock(e.arg);
+      break;
+    case SERIALFLASH_TRACE_ERASE_SECTOR:
+      CustoFlash.eraseSector(e.arg);
+      break;
+    }
+    uint32_t elapsed = (flash->now - start) / 1000;
+    lastEnd = e.time + e.elapsed;
+    if (e.op == SERIALFLASH_TRACE_BEGIN_WORK) {
+      SerialFlashSector active = log.getActiveSector();
+      value = ((uint32_t) active.getSectorIndex() << 16) | active.getWrittenCount();
+    }
+
+    //only part of a truncated readRecords() was replayed
+    bool same = value == e.value || (!complete && e.op == SERIALFLASH_TRACE_READ_RECORDS);
+    bool outputs = e.op == SERIALFLASH_TRACE_RETRIEVE_BACKLOGS || e.op == SERIALFLASH_TRACE_RETRIEVE_PACKED
+      || e.op == SERIALFLASH_TRACE_NEXT_BACKLOG_ADDRESS;
+    if (outputs) {
+      //the returned addresses are compared with the logged ones
+      same = same && (complete ? returned.size() == addresses.size() : returned.size() >= addresses.size());
+      for (size_t n = 0; same && n < addresses.size(); n++) {
+        same = packAddress(returned[n]) == packAddress(addresses[n]);
+      }
+    }
+    if (!same) {
+      if (mismatches < 20) {
+        printf("call %u %s(%x): device returned %x, replay %x\n",
+          calls, opNames[e.op], e.arg, e.value, value);
+      }
+      mismatches++;
+    }
+
+    OpStats_t *s = &stats[e.op];
+    s->calls++;
+    s->deviceTotal += e.elapsed;
+    s->replayTotal += elapsed;
+    if (e.elapsed > s->deviceMax) {
+      s->deviceMax = e.elapsed;
+    }
+    if (elapsed > s->replayMax) {
+      s->replayMax = elapsed;
+    }
+  }
+
+  printf("%-32s %8s %12s %12s %12s %12s\n", "call", "calls", "device avg", "device max", "replay avg", "replay max");
+  for (uint8_t op = 0; op < SERIALFLASH_TRACE_OP_COUNT; op++) {
+    OpStats_t *s = &stats[op];
+    if (s->calls == 0) {
+      continue;
+    }
+    printf("%-32s %8u %10.1fus %10uus %10.1fus %10uus\n", opNames[op], s->calls,
+      (double) s->deviceTotal / s->calls, s->deviceMax,
+      (double) s->replayTotal / s->calls, s->replayMax);
+  }
+  printf("%u calls replayed, %u mismatches\n", calls, mismatches);
+  if (orphans > 0 || truncated > 0) {
+    printf("%u address entries without their call skipped, %u calls with addresses missing\n", orphans, truncated);
+  }
+
+  SerialFlashChip::setBackend(NULL);
+  delete flash;
+  return mismatches > 0 ? 1 : 0;
+}
@@ -1,133 +1,372 @@
 #include "SerialFlashLayout.h"
 #include "SerialFlashSector.h"
 #include "SerialFlashRecord.h"
+#include "SerialFlashBacklogCursor.h"
 
-class CustoFlash {
-private:
+class CustoFlashStream {
+  friend class CustoFlash;
+
+protected:
   SerialFlashLayout layout;
 
   //For getNextBacklogAddress
-  uint16_t sectorIndex;
-  uint16_t recordIndex;
-  uint16_t terminateSector;
+  SerialFlashBacklogCursor backlogCursor;
 
 public:
-  void beginWork() {
-    layout.init();
-    layout.wakeup();
-    resetIndexes();
-  }
-  void endWork() {
-    layout.sleep();
-  }
   RecordAddress_t writeRecord(const void *record, uint8_t recordSize) {
-    RecordAddress_t ret;
-    ret.sectorIndex = layout.getCurrentSectorIndex();
-    ret.recordIndex = layout.getNextRecordIndex();
-    layout.writeRecord(record, recordSize);
+    SERIALFLASH_TIME(SERIALFLASH_OP_WRITE_RECORD);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_WRITE_RECORD, recordSize, tracePayload(record, recordSize));
+    RecordAddress_t ret = layout.writeRecord(record, recordSize);
+    SERIALFLASH_TRACE_VALUE(traceAddress(ret));
     return ret;
   }
   uint16_t readRecord(RecordAddress_t recordAddress, void *buf) {
-    return layout.readRecord(recordAddress, buf);
+    SERIALFLASH_TIME(SERIALFLASH_OP_READ_RECORD);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_READ_RECORD, 0, traceAddress(recordAddress));
+    uint16_t ret = layout.readRecord(recordAddress, buf);
+    SERIALFLASH_TRACE_VALUE(ret);
+    return ret;
   }
   uint16_t readRecords(RecordAddress_t* recordAddresses, uint16_t length, void *buf) {
-    return layout.readRecords(recordAddresses, length, buf);
+    SERIALFLASH_TIME(SERIALFLASH_OP_READ_RECORDS);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_READ_RECORDS, 0, length);
+    uint16_t ret = layout.readRecords(recordAddresses, length, buf);
+    SERIALFLASH_TRACE_VALUE(ret);
+    SERIALFLASH_TRACE_ADDRESSES(recordAddresses, length);
+    return ret;
+  }
+  uint16_t readRecords(RecordAddress_t* recordAddresses, uint16_t length, void *buf, uint8_t *recordSizes) {
+    SERIALFLASH_TIME(SERIALFLASH_OP_READ_RECORDS);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_READ_RECORDS, 0, length);
+    uint16_t ret = layout.readRecords(recordAddresses, length, buf, recordSizes);
+    SERIALFLASH_TRACE_VALUE(ret);
+    SERIALFLASH_TRACE_ADDRESSES(recordAddresses, length);
+    return ret;
   }
   void markRecordSent(RecordAddress_t recordAddr) {
+    SERIALFLASH_TIME(SERIALFLASH_OP_MARK_RECORD_SENT);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_MARK_RECORD_SENT, 0, traceAddress(recordAddr));
     layout.markRecordSent(recordAddr);
   }
   void markRecordsSent(RecordAddress_t* recordAddresses, uint16_t length) {
+    SERIALFLASH_TIME(SERIALFLASH_OP_MARK_RECORDS_SENT);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_MARK_RECORDS_SENT, 0, length);
+    SERIALFLASH_TRACE_ADDRESSES(recordAddresses, length);
     layout.markRecordsSent(recordAddresses, length);
   }
+  void markRangeSent(RecordAddress_t from, RecordAddress_t to) {
+    SERIALFLASH_TIME(SERIALFLASH_OP_MARK_RANGE_SENT);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_MARK_RANGE_SENT, 0, traceAddress(from));
+    SERIALFLASH_TRACE_ADDRESSES(&to, 1);
+    layout.markRangeSent(from, to);
+  }
   void markLatestWrittenRecordSent() {
+    SERIALFLASH_TIME(SERIALFLASH_OP_MARK_LATEST_SENT);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_MARK_LATEST_SENT, 0, 0);
     layout.markLatestWrittenRecordSent();
   }
   uint16_t getLatestWrittenRecordSector() {
-    return layout.getLatestWrittenRecordSector();
+    SERIALFLASH_TIME(SERIALFLASH_OP_QUERY);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_LATEST_WRITTEN_SECTOR, 0, 0);
+    uint16_t ret = layout.getLatestWrittenRecordSector();
+    SERIALFLASH_TRACE_VALUE(ret);
+    return ret;
   }
   uint16_t getLatestWrittenRecordIndex(uint16_t sectorIndex) {
-    return layout.getLatestWrittenRecordIndex(sectorIndex);
+    SERIALFLASH_TIME(SERIALFLASH_OP_QUERY);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_LATEST_WRITTEN_INDEX, 0, sectorIndex);
+    uint16_t ret = layout.getLatestWrittenRecordIndex(sectorIndex);
+    SERIALFLASH_TRACE_VALUE(ret);
+    return ret;
   }
   uint16_t getEarliestBacklogSector() {
-    return layout.getEarliestBacklogSector();
+    SERIALFLASH_TIME(SERIALFLASH_OP_QUERY);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_EARLIEST_BACKLOG_SECTOR, 0, 0);
+    uint16_t ret = layout.getEarliestBacklogSector();
+    SERIALFLASH_TRACE_VALUE(ret);
+    return ret;
   }
   uint16_t getEarliestBacklogIndex(uint16_t sectorIndex) {
-    return layout.getEarliestBacklogIndex(sectorIndex);
+    SERIALFLASH_TIME(SERIALFLASH_OP_QUERY);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_EARLIEST_BACKLOG_INDEX, 0, sectorIndex);
+    uint16_t ret = layout.getEarliestBacklogIndex(sectorIndex);
+    SERIALFLASH_TRACE_VALUE(ret);
+    return ret;
   }
   uint16_t getLatestBacklogSector() {
-    return layout.getLatestBacklogSector();
+    SERIALFLASH_TIME(SERIALFLASH_OP_QUERY);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_LATEST_BACKLOG_SECTOR, 0, 0);
+    uint16_t ret = layout.getLatestBacklogSector();
+    SERIALFLASH_TRACE_VALUE(ret);
+    return ret;
   }
   uint16_t getLatestBacklogIndex(uint16_t sectorIndex) {
-    return layout.getLatestBacklogIndex(sectorIndex);
+    SERIALFLASH_TIME(SERIALFLASH_OP_QUERY);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_LATEST_BACKLOG_INDEX, 0, sectorIndex);
+    uint16_t ret = layout.getLatestBacklogIndex(sectorIndex);
+    SERIALFLASH_TRACE_VALUE(ret);
+    return ret;
   }
   uint16_t getLatestBacklogIndex(uint16_t sectorIndex, uint16_t preceding) {
-    return layout.getLatestBacklogIndex(sectorIndex, preceding);
+    SERIALFLASH_TIME(SERIALFLASH_OP_QUERY);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_LATEST_BACKLOG_BEFORE, 0, ((uint32_t) sectorIndex << 16) | preceding);
+    uint16_t ret = layout.getLatestBacklogIndex(sectorIndex, preceding);
+    SERIALFLASH_TRACE_VALUE(ret);
+    return ret;
   }
   uint16_t retrieveLatestBacklogsAddresses(uint8_t payloadSize, RecordAddress_t *addresses) {
-    return layout.retrieveLatestBacklogsAddresses(payloadSize, addresses);
+    SERIALFLASH_TIME(SERIALFLASH_OP_RETRIEVE_BACKLOGS);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_RETRIEVE_BACKLOGS, payloadSize, 0);
+    uint16_t ret = layout.retrieveLatestBacklogsAddresses(payloadSize, addresses);
+    SERIALFLASH_TRACE_VALUE(ret);
+    SERIALFLASH_TRACE_ADDRESSES(addresses, ret);
+    return ret;
+  }
+  uint16_t retrievePackedBacklogsAddresses(uint8_t payloadSize, RecordAddress_t *addresses, uint8_t *offsets) {
+    SERIALFLASH_TIME(SERIALFLASH_OP_RETRIEVE_BACKLOGS);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_RETRIEVE_PACKED, payloadSize, 0);
+    uint16_t ret = layout.retrievePackedBacklogsAddresses(payloadSize, addresses, offsets);
+    SERIALFLASH_TRACE_VALUE(ret);
+    SERIALFLASH_TRACE_ADDRESSES(addresses, ret);
+    return ret;
   }
   uint16_t getNextRecordIndexForSector(uint16_t sectorIndex) {
-    return layout.getNextRecordIndexForSector(sectorIndex);
+    SERIALFLASH_TIME(SERIALFLASH_OP_QUERY);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_NEXT_RECORD_INDEX, 0, sectorIndex);
+    uint16_t ret = layout.getNextRecordIndexForSector(sectorIndex);
+    SERIALFLASH_TRACE_VALUE(ret);
+    return ret;
   }
   uint16_t getNextBacklogAddress(RecordAddress_t* recordAddr) {
-    uint16_t backlogIndex = layout.getLatestBacklogIndex(sectorIndex, recordIndex);
+    SERIALFLASH_TIME(SERIALFLASH_OP_NEXT_BACKLOG);
+    SERIALFLASH_TRACE_CALL(layout.getStream(), SERIALFLASH_TRACE_NEXT_BACKLOG_ADDRESS, 0, 0);
+    if (!backlogCursor.next(recordAddr)) {
+      backlogCursor.rewind();
+      SERIALFLASH_TRACE_VALUE(NO_BACKLOG_RECORD);
+      return NO_BACKLOG_RECORD;
+    }
 
-    while (backlogIndex == NO_BACKLOG_RECORD) {
-      sectorIndex = sectorIndex < 1 ? MAX_SECTOR - 1 : sectorIndex - 1;
-      backlogIndex = layout.getLatestBacklogIndex(sectorIndex);
+    uint16_t ret = layout.getRecordSize(*recordAddr);
+    SERIALFLASH_TRACE_VALUE(ret);
+    SERIALFLASH_TRACE_ADDRESSES(recordAddr, 1);
+    return ret;
+  }
 
-      if (sectorIndex == terminateSector) {
-        resetIndexes();
-        return NO_BACKLOG_RECORD;
-      }
+  uint8_t getRecordSize(RecordAddress_t recordAddress) {
+    SERIALFLASH_TIME(SERIALFLASH_OP_QUERY);
+    return layout.getRecordSize(recordAddress);
+  }
+
+  uint8_t getStream() {
+    return layout.getStream();
+  }
+
+  //Unsent records, free sectors and age of the backlog of this stream, cheap
+  //enough to poll before every transmission
+  BacklogReport_t getBacklogReport() {
+    SERIALFLASH_TIME(SERIALFLASH_OP_QUERY);
+    return layout.getBacklogReport();
+  }
+
+  //Functions instantiating other classes
+  SerialFlashSector getActiveSector() {
+    SERIALFLASH_TIME(SERIALFLASH_OP_QUERY);
+    uint16_t activeSector = layout.getCurrentSectorIndex();
+    SerialFlashSector sector(activeSector);
+    return sector;
+  }
+  SerialFlashBacklogCursor getBacklogCursor(bool earliestFirst = false) {
+    SerialFlashBacklogCursor cursor(layout.getStream(), earliestFirst);
+    return cursor;
+  }
+
+protected:
+  void setStream(uint8_t streamIndex) {
+    layout.setStream(streamIndex);
+    backlogCursor.setStream(streamIndex);
+  }
+  void mount() {
+    layout.init();
+    backlogCursor.rewind();
+  }
+
+#ifdef SERIALFLASH_TRACE
+  static uint32_t traceAddress(RecordAddress_t address) {
+    return ((uint32_t) address.sectorIndex << 16) | address.recordIndex;
+  }
+  static uint32_t tracePayload(const void *record, uint8_t recordSize) {
+    //first bytes of the record, little endian
+    uint32_t payload = 0;
+    for (uint8_t n = 0; n < recordSize && n < 4; n++) {
+      payload |= (uint32_t) ((const uint8_t *) record)[n] << (8 * n);
     }
+    return payload;
+  }
+#endif
 
-    SectorFlags_t flags;
-    uint32_t flagAddress = (sectorIndex + 1) * SECTOR_SIZE - 5;
-    layout.read(flagAddress, &flags, 5);
+};
 
-    recordIndex = backlogIndex;
-    recordAddr -> sectorIndex = sectorIndex;
-    recordAddr -> recordIndex = backlogIndex;
+// The first stream, with the chip-wide functions. The other streams are
+// reached with stream().
+class CustoFlash : public CustoFlashStream {
+private:
+#if STREAM_COUNT > 1
+  CustoFlashStream streams[STREAM_COUNT - 1];
+#endif
 
-    return flags.s;
+public:
+  CustoFlash() {
+#if STREAM_COUNT > 1
+    for (uint8_t n = 1; n < STREAM_COUNT; n++) {
+      streams[n - 1].setStream(n);
+    }
+#endif
+  }
+  void beginWork() {
+    SERIALFLASH_TIME(SERIALFLASH_OP_BEGIN_WORK);
+    SERIALFLASH_TRACE_CALL(0, SERIALFLASH_TRACE_BEGIN_WORK, 0, 0);
+    layout.wakeup();
+    for (uint8_t n = 0; n < STREAM_COUNT; n++) {
+      stream(n).mount();
+    }
+    SERIALFLASH_TRACE_VALUE(((uint32_t) layout.getCurrentSectorIndex() << 16) | layout.getNextRecordIndex());
+  }
+  void endWork() {
+    SERIALFLASH_TIME(SERIALFLASH_OP_END_WORK);
+    SERIALFLASH_TRACE_CALL(0, SERIALFLASH_TRACE_END_WORK, 0, 0);
+    layout.flushBitmapCache();
+    layout.sleep();
+  }
+  CustoFlashStream &stream(uint8_t streamIndex) {
+#if STREAM_COUNT > 1
+    if (streamIndex > 0 && streamIndex < STREAM_COUNT) {
+      return streams[streamIndex - 1];
+    }
+#else
+    (void) streamIndex;
+#endif
+    return *this;
+  }
+
+  //Restricts the rings to sectorCount sectors from firstSector, call before beginWork()
+  void setPartition(uint16_t firstSector, uint16_t sectorCount) {
+    layout.setPartition(firstSector, sectorCount);
   }
 
   //From SerialFlashChip
   void read(uint32_t addr, void *buf, uint32_t len) {
+    SERIALFLASH_TIME(SERIALFLASH_OP_READ);
+    SERIALFLASH_TRACE_CALL(0, SERIALFLASH_TRACE_READ, 0, addr);
+    SERIALFLASH_TRACE_VALUE(len);
+    layout.flushBitmapCache();
     layout.read(addr, buf, len);
   }
   void write(uint32_t addr, const void *buf, uint32_t len) {
+    SERIALFLASH_TIME(SERIALFLASH_OP_WRITE);
+    SERIALFLASH_TRACE_CALL(0, SERIALFLASH_TRACE_WRITE, 0, addr);
+    SERIALFLASH_TRACE_VALUE(len);
+    layout.flushBitmapCache();
     layout.write(addr, buf, len);
+    layout.invalidateSectorTable();
+  }
+  void writeAsync(uint32_t addr, const void *buf, uint32_t len) {
+    SERIALFLASH_TIME(SERIALFLASH_OP_WRITE_ASYNC);
+    SERIALFLASH_TRACE_CALL(0, SERIALFLASH_TRACE_WRITE_ASYNC, 0, addr);
+    SERIALFLASH_TRACE_VALUE(len);
+    layout.flushBitmapCache();
+    layout.writeAsync(addr, buf, len);
+    layout.invalidateSectorTable();
+  }
+  bool ready() {
+    SERIALFLASH_TIME(SERIALFLASH_OP_READY);
+    return layout.ready();
   }
   void eraseAll() {
+    SERIALFLASH_TIME(SERIALFLASH_OP_ERASE);
+    SERIALFLASH_TRACE_CALL(0, SERIALFLASH_TRACE_ERASE_ALL, 0, 0);
+    layout.flushBitmapCache();
     layout.eraseAll();
+    layout.invalidateSectorTable();
   }
   void eraseSector(uint32_t addr) {
+    SERIALFLASH_TIME(SERIALFLASH_OP_ERASE);
+    SERIALFLASH_TRACE_CALL(0, SERIALFLASH_TRACE_ERASE_SECTOR, 0, addr);
+    layout.flushBitmapCache();
     layout.eraseSector(addr);
+    layout.invalidateSectorTable();
   }
   void eraseBlock(uint32_t addr) {
+    SERIALFLASH_TIME(SERIALFLASH_OP_ERASE);
+    SERIALFLASH_TRACE_CALL(0, SERIALFLASH_TRACE_ERASE_BLOCK, 0, addr);
+    layout.flushBitmapCache();
     layout.eraseBlock(addr);
+    layout.invalidateSectorTable();
+  }
+
+  //Written, unsent and capacity counts of a sector
+  SectorStats_t getSectorStats(uint16_t sectorIndex) {
+    SERIALFLASH_TIME(SERIALFLASH_OP_QUERY);
+    return layout.getSectorStats(sectorIndex);
+  }
+
+  //Backlog reports of every stream added up, the age and utilisation are
+  //those of the stream closest to erasing unsent records
+  BacklogReport_t getDeviceReport() {
+    BacklogReport_t total = getBacklogReport();
+    for (uint8_t n = 1; n < STREAM_COUNT; n++) {
+      BacklogReport_t report = stream(n).getBacklogReport();
+      total.unsentRecords += report.unsentRecords;
+      total.backlogSectors += report.backlogSectors;
+      total.freeSectors += report.freeSectors;
+      total.ringSectors += report.ringSectors;
+      if (report.oldestBacklogAge != NO_BACKLOG_SECTOR
+        && (total.oldestBacklogAge == NO_BACKLOG_SECTOR || report.utilisation > total.utilisation)) {
+        total.oldestBacklogAge = report.oldestBacklogAge;
+        total.utilisation = report.utilisation;
+      }
+    }
+    return total;
   }
 
   //Functions instantiating other classes
   SerialFlashSector getSector(uint16_t sectorIndex) {
+    SERIALFLASH_TIME(SERIALFLASH_OP_QUERY);
     SerialFlashSector sector(sectorIndex);
     return sector;
   }
-  SerialFlashSector getActiveSector() {
-    uint16_t activeSector = layout.getCurrentSectorIndex();
-    SerialFlashSector sector(activeSector);
-    return sector;
+
+#ifdef SERIALFLASH_STATS
+  //Counters and latency histograms
+  const SerialFlashStats_t &getStats() {
+    return SerialFlashProfiler::stats;
+  }
+  void resetStats() {
+    SerialFlashProfiler::reset();
   }
+  void printStats(Print &out) {
+    SerialFlashProfiler::print(out);
+  }
+#endif
 
-private:
-  void resetIndexes() {
-    sectorIndex = layout.getCurrentSectorIndex();
-    recordIndex = layout.getNextRecordIndexForSector(sectorIndex);
-    terminateSector = sectorIndex + 1 >= MAX_SECTOR ? 0 : sectorIndex + 1;
+#ifdef PAGE_CACHE_SIZE
+  //Page cache counters, to size PAGE_CACHE_SIZE for a board
+  const PageCacheStats_t &getPageCacheStats() {
+    return layout.getPageCacheStats();
+  }
+  void resetPageCacheStats() {
+    layout.resetPageCacheStats();
   }
+#endif
 
+#ifdef SERIALFLASH_TRACE
+  //Trace of the latest calls, see extras/host/custoflash_replay.cpp
+  void dumpTrace(Print &out) {
+    SerialFlashTrace::dump(out);
+  }
+  void clearTrace() {
+    SerialFlashTrace::clear();
+  }
+#endif
 };
 
 CustoFlash CustoFlash;
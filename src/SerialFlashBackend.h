@@ -0,0 +1,24 @@
+#ifndef INCLUDE_SERIAL_FLASH_BACKEND
+#define INCLUDE_SERIAL_FLASH_BACKEND
+
+#include <inttypes.h>
+
+// Storage used in place of the SPI flash chip, see SerialFlashChip::setBackend().
+// Implementations must behave like NOR flash: programming only clears bits,
+// erasing sets every byte of the erased area to 0xFF.
+class SerialFlashBackend
+{
+public:
+	virtual ~SerialFlashBackend() {}
+	virtual void readID(uint8_t *buf) = 0;
+	virtual void read(uint32_t addr, void *buf, uint32_t len) = 0;
+	virtual void write(uint32_t addr, const void *buf, uint32_t len) = 0;
+	virtual void eraseSector(uint32_t addr) = 0;
+	virtual void eraseBlock(uint32_t addr) = 0;
+	virtual void eraseAll() = 0;
+	virtual bool ready() { return true; }
+	virtual void sleep() {}
+	virtual void wakeup() {}
+};
+
+#endif
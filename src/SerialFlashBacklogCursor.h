@@ -0,0 +1,162 @@
+#ifndef INCLUDE_SERIAL_FLASH_BACKLOG_CURSOR
+#define INCLUDE_SERIAL_FLASH_BACKLOG_CURSOR
+
+#include "SerialFlashLayout.h"
+
+// Unsent bitmap bytes loaded at a time by a cursor, 8 records per byte
+#ifndef BACKLOG_CURSOR_WINDOW
+#define BACKLOG_CURSOR_WINDOW   32
+#endif
+
+// Walks the backlogs of a stream, latest first or earliest first. The unsent
+// bits of a sector are read a window at a time and scanned in RAM, and only
+// sectors marked in the backlog summary are visited, so a full walk reads
+// every bitmap byte once. Records marked sent during the walk may still be
+// returned when their bits were already loaded.
+class SerialFlashBacklogCursor : virtual public SerialFlashLayout {
+
+private:
+  bool forward;
+  bool started = false;
+  uint16_t sectorIndex = NO_BACKLOG_SECTOR;
+  uint16_t lastSector = NO_BACKLOG_SECTOR;  // sector the walk ends with
+  uint16_t written = 0;                     // records written in sectorIndex
+  uint16_t position = 0;                    // next record index to look at, or one past it backwards
+  uint16_t windowFirst = 0;                 // first bitmap byte in window
+  uint16_t windowLength = 0;
+  uint8_t window[BACKLOG_CURSOR_WINDOW] __attribute__((aligned(4)));  // scanned a word at a time
+
+  void enterSector(uint16_t sector) {
+    sectorIndex = sector;
+    written = sector == NO_BACKLOG_SECTOR ? 0 : getNextRecordIndexForSector(sector);
+    written = written == CORRUPTED_FILESYSTEM ? 0 : written;
+    position = forward ? 0 : written;
+    windowLength = 0;
+  }
+
+  void leaveSector() {
+    if (sectorIndex == lastSector) {
+      enterSector(NO_BACKLOG_SECTOR);
+      return;
+    }
+    uint16_t sector = seekBacklogSector(sectorIndex, forward);
+    enterSector(sector == sectorIndex ? NO_BACKLOG_SECTOR : sector);
+  }
+
+  // Loads the window holding bitmap byte, returns the bit index it starts at
+  uint16_t loadWindow(uint16_t byte) {
+    if (byte < windowFirst || byte >= windowFirst + windowLength) {
+      //forwards the window starts at byte, backwards it ends there
+      uint16_t usedBytes = SectorGeometry::bitmapLength(written);
+      if (forward) {
+        windowFirst = byte;
+      } else {
+        windowFirst = byte + 1 > BACKLOG_CURSOR_WINDOW ? byte + 1 - BACKLOG_CURSOR_WINDOW : 0;
+      }
+      windowLength = usedBytes - windowFirst < BACKLOG_CURSOR_WINDOW ? usedBytes - windowFirst : BACKLOG_CURSOR_WINDOW;
+      readUnsentBits(sectorIndex, window, windowFirst, windowLength);
+    }
+    return windowFirst * 8;
+  }
+
+public:
+  SerialFlashBacklogCursor(uint8_t streamIndex = 0, bool earliestFirst = false) {
+    setStream(streamIndex);
+    forward = earliestFirst;
+  }
+
+  // Starts the walk again from the latest (or earliest) backlog
+  void rewind() {
+    started = false;
+  }
+
+  // Writes the next backlog address, returns false when the walk is over
+  bool next(RecordAddress_t *recordAddr) {
+    if (!started) {
+      started = true;
+      uint16_t head = getLatestBacklogSector();
+      uint16_t tail = getEarliestBacklogSector();
+      lastSector = forward ? head : tail;
+      enterSector(forward ? tail : head);
+    }
+
+    while (sectorIndex != NO_BACKLOG_SECTOR) {
+      if (forward && position < written) {
+        //bits of records not written yet are past the end of the scan
+        uint16_t base = loadWindow(position / 8);
+        uint16_t end = (windowFirst + windowLength) * 8 < written ? (windowFirst + windowLength) * 8 : written;
+        position = base + SerialFlashBitmap::findFirstSet(window, position - base, end - base) + 1;
+        if (position > end) {
+          position = end;
+          continue;
+        }
+        recordAddr->sectorIndex = sectorIndex;
+        recordAddr->recordIndex = position - 1;
+        return true;
+      }
+      if (!forward && position > 0) {
+        uint16_t base = loadWindow((position - 1) / 8);
+        uint16_t found = SerialFlashBitmap::findLastSetBefore(window, position - base);
+        if (found == SERIALFLASH_NO_BIT) {
+          position = base;
+          continue;
+        }
+        position = base + found;
+        recordAddr->sectorIndex = sectorIndex;
+        recordAddr->recordIndex = position;
+        return true;
+      }
+      leaveSector();
+    }
+    return false;
+  }
+
+  // Read-ahead: takes up to count next backlogs and reads their records into
+  // buf with one readRecords() call, returns the number of records taken
+  uint16_t readNext(RecordAddress_t *recordAddresses, uint16_t count, void *buf, uint8_t *recordSizes) {
+    uint16_t taken = 0;
+    while (taken < count && next(recordAddresses + taken)) {
+      taken++;
+    }
+    if (taken > 0) {
+      readRecords(recordAddresses, taken, buf, recordSizes);
+    }
+    return taken;
+  }
+
+  class Iterator {
+  private:
+    SerialFlashBacklogCursor *cursor;
+    RecordAddress_t address;
+    bool valid;
+
+  public:
+    Iterator(SerialFlashBacklogCursor *c) : cursor(c), valid(false) {
+      if (cursor != NULL) {
+        valid = cursor->next(&address);
+      }
+    }
+    RecordAddress_t operator*() const {
+      return address;
+    }
+    Iterator &operator++() {
+      valid = cursor->next(&address);
+      return *this;
+    }
+    bool operator!=(const Iterator &other) const {
+      return valid != other.valid;
+    }
+  };
+
+  // for (RecordAddress_t address : cursor) walks from the start
+  Iterator begin() {
+    rewind();
+    return Iterator(this);
+  }
+
+  Iterator end() {
+    return Iterator(NULL);
+  }
+};
+
+#endif //INCLUDE_SERIAL_FLASH_BACKLOG_CURSOR
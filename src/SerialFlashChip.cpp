@@ -28,12 +28,21 @@
 #include "SerialFlashChip.h"
 #include "util/SerialFlash_directwrite.h"
 
-#define CSASSERT()  DIRECT_WRITE_LOW(cspin_basereg, cspin_bitmask)
+#define CSASSERT()  do { SERIALFLASH_STAT(commands, 1); DIRECT_WRITE_LOW(cspin_basereg, cspin_bitmask); } while (0)
 #define CSRELEASE() DIRECT_WRITE_HIGH(cspin_basereg, cspin_bitmask)
-#define SPICONFIG   SPISettings(50000000, MSBFIRST, SPI_MODE0)
+#define SPICONFIG   SPISettings(spiClock, MSBFIRST, SPI_MODE0)
 
 uint8_t SerialFlashChip::flags = 0;
 uint8_t SerialFlashChip::busy = 0;
+uint32_t SerialFlashChip::spiClock = 50000000;
+SerialFlashBackend *SerialFlashChip::backend = NULL;
+uint32_t SerialFlashChip::eraseStart = 0;
+uint32_t SerialFlashChip::eraseEnd = 0;
+#if WRITE_QUEUE_SIZE > 0
+SerialFlashChip::QueuedPage SerialFlashChip::writeQueue[WRITE_QUEUE_SIZE];
+uint8_t SerialFlashChip::writeQueueHead = 0;
+uint8_t SerialFlashChip::writeQueueCount = 0;
+#endif
 
 static volatile IO_REG_TYPE *cspin_basereg;
 static IO_REG_TYPE cspin_bitmask;
@@ -45,13 +54,37 @@ static SPIClass& SPIPORT = SPI;
 #define FLAG_DIFF_SUSPEND	0x04	// uses 2 different suspend commands
 #define FLAG_MULTI_DIE		0x08	// multiple die, don't read cross 32M barrier
 #define FLAG_256K_BLOCKS	0x10	// has 256K erase blocks
+#define FLAG_FAST_READ		0x20	// reads with FAST READ (0x0B) and a dummy byte
 #define FLAG_DIE_MASK		0xC0	// top 2 bits count during multi-die erase
 
+#ifdef SERIALFLASH_USE_DMA
+#define DMAWAIT()	SerialFlashDMA::wait()	// a queued page may still be sent
+#else
+#define DMAWAIT()
+#endif
+
+#if WRITE_QUEUE_SIZE > 0
+#define QUEUED_PAGES	writeQueueCount
+#else
+#define QUEUED_PAGES	0	// writeAsync() programs before returning
+#endif
+
 void SerialFlashChip::wait(void)
+{
+	if (backend) return;
+	// also program every page queued by writeAsync()
+	do {
+		waitBusy();
+	} while (programQueuedPage());
+}
+
+void SerialFlashChip::waitBusy(void)
 {
 	uint32_t status;
+	DMAWAIT();
 	//Serial.print("wait-");
 	while (1) {
+		SERIALFLASH_STAT(waitPolls, 1);
 		SPIPORT.beginTransaction(SPICONFIG);
 		CSASSERT();
 		if (flags & FLAG_STATUS_CMD70) {
@@ -79,9 +112,18 @@ void SerialFlashChip::wait(void)
 
 void SerialFlashChip::read(uint32_t addr, void *buf, uint32_t len)
 {
+	SERIALFLASH_STAT(bytesRead, len);
+	if (backend) {
+		backend->read(addr, buf, len);
+		return;
+	}
 	uint8_t *p = (uint8_t *)buf;
 	uint8_t b, f, status, cmd;
+#if WRITE_QUEUE_SIZE > 0
+	uint32_t start = addr, total = len;
+#endif
 
+	DMAWAIT();
 	memset(p, 0, len);
 	f = flags;
 	SPIPORT.beginTransaction(SPICONFIG);
@@ -106,6 +148,7 @@ void SerialFlashChip::read(uint32_t addr, void *buf, uint32_t len)
 			// TODO: this may not work on Spansion chips
 			// which apparently have 2 different suspend
 			// commands, for program vs erase
+			SERIALFLASH_STAT(eraseSuspends, 1);
 			CSASSERT();
 			SPIPORT.transfer(0x06); // write enable (Micron req'd)
 			CSRELEASE();
@@ -135,7 +178,7 @@ void SerialFlashChip::read(uint32_t addr, void *buf, uint32_t len)
 		} else {
 			// chip is busy with an operation that can not suspend
 			SPIPORT.endTransaction();	// is this a good idea?
-			wait();			// should we wait without ending
+			waitBusy();		// should we wait without ending
 			b = 0;			// the transaction??
 			SPIPORT.beginTransaction(SPICONFIG);
 		}
@@ -148,15 +191,25 @@ void SerialFlashChip::read(uint32_t addr, void *buf, uint32_t len)
 			}
 		}
 		CSASSERT();
-		// TODO: FIFO optimize....
+		cmd = (f & FLAG_FAST_READ) ? 0x0B : 0x03;
 		if (f & FLAG_32BIT_ADDR) {
-			SPIPORT.transfer(0x03);
+			SPIPORT.transfer(cmd);
 			SPIPORT.transfer16(addr >> 16);
 			SPIPORT.transfer16(addr);
 		} else {
-			SPIPORT.transfer16(0x0300 | ((addr >> 16) & 255));
+			SPIPORT.transfer16((cmd << 8) | ((addr >> 16) & 255));
 			SPIPORT.transfer16(addr);
 		}
+		if (f & FLAG_FAST_READ) SPIPORT.transfer(0); // dummy byte
+#ifdef SERIALFLASH_USE_DMA
+		if (rdlen >= SERIALFLASH_DMA_MIN_LENGTH && SerialFlashDMA::available()) {
+			for (uint32_t n = 0; n < rdlen; n += 65535) {
+				uint16_t dmalen = rdlen - n < 65535 ? rdlen - n : 65535;
+				SerialFlashDMA::transfer(NULL, p + n, dmalen, NULL);
+				SerialFlashDMA::wait();
+			}
+		} else
+#endif
 		SPIPORT.transfer(p, rdlen);
 		CSRELEASE();
 		p += rdlen;
@@ -175,48 +228,225 @@ void SerialFlashChip::read(uint32_t addr, void *buf, uint32_t len)
 		CSRELEASE();
 	}
 	SPIPORT.endTransaction();
+#if WRITE_QUEUE_SIZE > 0
+	// bytes queued by writeAsync() will be programmed over these
+	p = (uint8_t *)buf;
+	for (uint8_t n = 0; n < writeQueueCount; n++) {
+		const QueuedPage *q = &writeQueue[(writeQueueHead + n) % WRITE_QUEUE_SIZE];
+		uint32_t from = q->addr > start ? q->addr : start;
+		uint32_t to = q->addr + q->len < start + total ? q->addr + q->len : start + total;
+		for (uint32_t a = from; a < to; a++) {
+			p[a - start] &= q->data[a - q->addr];
+		}
+	}
+#endif
 }
 
 void SerialFlashChip::write(uint32_t addr, const void *buf, uint32_t len)
 {
+	SERIALFLASH_STAT(bytesWritten, len);
+	SERIALFLASH_STAT(programs, ((addr & 0xFF) + len + 0xFF) >> 8);
+	if (backend) {
+		backend->write(addr, buf, len);
+		return;
+	}
 	const uint8_t *p = (const uint8_t *)buf;
 	uint32_t max, pagelen;
-
+	bool suspended = false;
+
+	DMAWAIT();
+	if (QUEUED_PAGES) wait();
+	if (busy == 2 && (addr >= eraseEnd || addr + len <= eraseStart) && !ready()) {
+		// program pages outside the erased area while the erase is suspended
+		suspendErase();
+		suspended = true;
+	}
 	//Serial.printf("WR: addr %08X, len %d\n", addr, len);
 	do {
 		if (busy) wait();
-		SPIPORT.beginTransaction(SPICONFIG);
-		CSASSERT();
-		// write enable command
-		SPIPORT.transfer(0x06);
-		CSRELEASE();
 		max = 256 - (addr & 0xFF);
 		pagelen = (len <= max) ? len : max;
-		//Serial.printf("WR: addr %08X, pagelen %d\n", addr, pagelen);
-		delayMicroseconds(1); // TODO: reduce this, but prefer safety first
-		CSASSERT();
-		if (flags & FLAG_32BIT_ADDR) {
-			SPIPORT.transfer(0x02); // program page command
-			SPIPORT.transfer16(addr >> 16);
-			SPIPORT.transfer16(addr);
-		} else {
-			SPIPORT.transfer16(0x0200 | ((addr >> 16) & 255));
-			SPIPORT.transfer16(addr);
+		programPage(addr, p, pagelen, false);
+		addr += pagelen;
+		p += pagelen;
+		len -= pagelen;
+	} while (len > 0);
+	if (suspended) {
+		wait();
+		resumeErase();
+	}
+}
+
+void SerialFlashChip::writeAsync(uint32_t addr, const void *buf, uint32_t len)
+{
+#if WRITE_QUEUE_SIZE == 0
+	write(addr, buf, len);
+#else
+	SERIALFLASH_STAT(bytesWritten, len);
+	SERIALFLASH_STAT(programs, ((addr & 0xFF) + len + 0xFF) >> 8);
+	if (backend) {
+		backend->write(addr, buf, len);
+		return;
+	}
+	const uint8_t *p = (const uint8_t *)buf;
+	uint32_t max, pagelen;
+
+	DMAWAIT();	// the page in flight is read from the queue
+	while (len > 0) {
+		max = 256 - (addr & 0xFF);
+		pagelen = (len <= max) ? len : max;
+		while (writeQueueCount >= WRITE_QUEUE_SIZE) {
+			// queue is full, wait for the oldest page to start
+			waitBusy();
+			programQueuedPage();
 		}
+		QueuedPage *q = &writeQueue[(writeQueueHead + writeQueueCount) % WRITE_QUEUE_SIZE];
+		q->addr = addr;
+		q->len = pagelen;
+		memcpy(q->data, p, pagelen);
+		writeQueueCount++;
 		addr += pagelen;
+		p += pagelen;
 		len -= pagelen;
+	}
+	ready();	// start programming if the chip is idle
+#endif
+}
+
+void SerialFlashChip::programPage(uint32_t addr, const uint8_t *p, uint32_t len, bool async)
+{
+	SPIPORT.beginTransaction(SPICONFIG);
+	CSASSERT();
+	// write enable command
+	SPIPORT.transfer(0x06);
+	CSRELEASE();
+	//Serial.printf("WR: addr %08X, pagelen %d\n", addr, len);
+	delayMicroseconds(1); // TODO: reduce this, but prefer safety first
+	CSASSERT();
+	if (flags & FLAG_32BIT_ADDR) {
+		SPIPORT.transfer(0x02); // program page command
+		SPIPORT.transfer16(addr >> 16);
+		SPIPORT.transfer16(addr);
+	} else {
+		SPIPORT.transfer16(0x0200 | ((addr >> 16) & 255));
+		SPIPORT.transfer16(addr);
+	}
+#ifdef SERIALFLASH_USE_DMA
+	if (len >= SERIALFLASH_DMA_MIN_LENGTH && SerialFlashDMA::available()) {
+		// chip select is released by transferDone()
+		busy = 4;
+		SerialFlashDMA::transfer(p, NULL, len, transferDone);
+		if (!async) SerialFlashDMA::wait();
+		return;
+	}
+#else
+	(void)async;	// the transfer completes before returning
+#endif
+	do {
+		SPIPORT.transfer(*p++);
+	} while (--len > 0);
+	CSRELEASE();
+	busy = 4;
+	SPIPORT.endTransaction();
+}
+
+void SerialFlashChip::transferDone()
+{
+	// called from the DMAC interrupt at the end of a page program
+	CSRELEASE();
+	SPIPORT.endTransaction();
+}
+
+void SerialFlashChip::setBackend(SerialFlashBackend *storage)
+{
+	// every operation goes to storage instead of the SPI chip, NULL restores it
+	wait();
+	backend = storage;
+	busy = 0;
+#if WRITE_QUEUE_SIZE > 0
+	writeQueueCount = 0;
+#endif
+}
+
+void SerialFlashChip::onTransferComplete(void (*callback)())
+{
+#ifdef SERIALFLASH_USE_DMA
+	SerialFlashDMA::callback = callback;
+#else
+	(void)callback;	// transfers complete before returning
+#endif
+}
+
+bool SerialFlashChip::programQueuedPage()
+{
+#if WRITE_QUEUE_SIZE > 0
+	// start the oldest queued page, the chip must not be busy
+	if (!writeQueueCount) return false;
+	const QueuedPage *q = &writeQueue[writeQueueHead];
+	programPage(q->addr, q->data, q->len, true);
+	writeQueueHead = (writeQueueHead + 1) % WRITE_QUEUE_SIZE;
+	writeQueueCount--;
+	return true;
+#else
+	return false;	// nothing is ever queued
+#endif
+}
+
+void SerialFlashChip::suspendErase()
+{
+	uint8_t status;
+	SERIALFLASH_STAT(eraseSuspends, 1);
+	SPIPORT.beginTransaction(SPICONFIG);
+	CSASSERT();
+	SPIPORT.transfer(0x06); // write enable (Micron req'd)
+	CSRELEASE();
+	delayMicroseconds(1);
+	CSASSERT();
+	SPIPORT.transfer(0x75); // Suspend erase
+	CSRELEASE();
+	if (flags & FLAG_STATUS_CMD70) {
+		// Micron chips don't actually suspend until flags read
+		CSASSERT();
+		SPIPORT.transfer(0x70);
 		do {
-			SPIPORT.transfer(*p++);
-		} while (--pagelen > 0);
+			status = SPIPORT.transfer(0);
+		} while (!(status & 0x80));
 		CSRELEASE();
-		busy = 4;
-		SPIPORT.endTransaction();
-	} while (len > 0);
+	} else {
+		CSASSERT();
+		SPIPORT.transfer(0x05);
+		do {
+			status = SPIPORT.transfer(0);
+		} while ((status & 0x01));
+		CSRELEASE();
+	}
+	SPIPORT.endTransaction();
+	busy = 0;
+}
+
+void SerialFlashChip::resumeErase()
+{
+	SPIPORT.beginTransaction(SPICONFIG);
+	CSASSERT();
+	SPIPORT.transfer(0x06); // write enable (Micron req'd)
+	CSRELEASE();
+	delayMicroseconds(1);
+	CSASSERT();
+	SPIPORT.transfer(0x7A); // Resume erase
+	CSRELEASE();
+	SPIPORT.endTransaction();
+	busy = 2;
 }
 
 void SerialFlashChip::eraseAll()
 {
-	if (busy) wait();
+	SERIALFLASH_STAT(chipErases, 1);
+	if (backend) {
+		backend->eraseAll();
+		return;
+	}
+	DMAWAIT();
+	if (busy || QUEUED_PAGES) wait();
 	uint8_t id[5];
 	readID(id);
 	//Serial.printf("ID: %02X %02X %02X\n", id[0], id[1], id[2]);
@@ -265,8 +495,14 @@ void SerialFlashChip::eraseAll()
 
 void SerialFlashChip::eraseBlock(uint32_t addr)
 {
+	SERIALFLASH_STAT(blockErases, 1);
+	if (backend) {
+		backend->eraseBlock(addr);
+		return;
+	}
 	uint8_t f = flags;
-	if (busy) wait();
+	DMAWAIT();
+	if (busy || QUEUED_PAGES) wait();
 	SPIPORT.beginTransaction(SPICONFIG);
 	CSASSERT();
 	SPIPORT.transfer(0x06); // write enable command
@@ -283,14 +519,21 @@ void SerialFlashChip::eraseBlock(uint32_t addr)
 	}
 	CSRELEASE();
 	SPIPORT.endTransaction();
+	eraseStart = addr & ~(blockSize() - 1);
+	eraseEnd = eraseStart + blockSize();
 	busy = 2;
 }
 
 
 bool SerialFlashChip::ready()
 {
+	if (backend) return backend->ready();
 	uint32_t status;
-	if (!busy) return true;
+#ifdef SERIALFLASH_USE_DMA
+	if (SerialFlashDMA::active()) return false;
+#endif
+	// an idle chip starts the next page queued by writeAsync()
+	if (!busy) return !programQueuedPage();
 	SPIPORT.beginTransaction(SPICONFIG);
 	CSASSERT();
 	if (flags & FLAG_STATUS_CMD70) {
@@ -317,7 +560,7 @@ bool SerialFlashChip::ready()
 		eraseAll();
 		return false;
 	}
-	return true;
+	return !programQueuedPage();
 }
 
 
@@ -327,6 +570,38 @@ bool SerialFlashChip::ready()
 #define ID0_MACRONIX	0xC2
 #define ID0_SST		0xBF
 
+// FAST READ (0x0B) clock of each part, from its datasheet and capped at
+// 104 MHz. Parts that share an ID take the slowest of them, and low voltage
+// variants (other memory type byte) are not listed.
+static const struct {
+	uint8_t id[3];		// manufacturer, memory type, capacity
+	uint8_t mhz;
+} fastReadClocks[] = {
+	{{ID0_WINBOND, 0x40, 0x14}, 104},	// W25Q80DV
+	{{ID0_WINBOND, 0x40, 0x15}, 104},	// W25Q16DV
+	{{ID0_WINBOND, 0x40, 0x16}, 104},	// W25Q32FV
+	{{ID0_WINBOND, 0x40, 0x17}, 80},	// W25Q64CV, W25Q64FV
+	{{ID0_WINBOND, 0x40, 0x18}, 104},	// W25Q128FV
+	{{ID0_WINBOND, 0x40, 0x19}, 104},	// W25Q256FV
+	{{ID0_SPANSION, 0x02, 0x16}, 80},	// S25FL064A
+	{{ID0_SPANSION, 0x20, 0x18}, 104},	// S25FL127S, S25FL128P
+	{{ID0_SPANSION, 0x02, 0x19}, 104},	// S25FL256S
+	{{ID0_SPANSION, 0x02, 0x20}, 104},	// S25FL512S
+	{{ID0_MACRONIX, 0x20, 0x18}, 50},	// MX25L12805D, MX25L12835F
+	{{ID0_MACRONIX, 0x20, 0x1A}, 104},	// MX66L51235F
+	{{ID0_MICRON, 0x20, 0x14}, 75},	// M25P80
+	{{ID0_MICRON, 0x20, 0x18}, 50},	// M25P128
+	{{ID0_MICRON, 0xBA, 0x18}, 104},	// N25Q128A
+	{{ID0_MICRON, 0xBA, 0x20}, 104},	// N25Q512A
+	{{ID0_MICRON, 0xBA, 0x21}, 104},	// N25Q00AA
+	{{ID0_MICRON, 0xBA, 0x22}, 104},	// MT25QL02GC
+	{{ID0_SST, 0x25, 0x41}, 80},	// SST25VF016B
+	{{ID0_SST, 0x25, 0x4A}, 80},	// SST25VF032B
+	{{ID0_SST, 0x26, 0x01}, 80},	// SST26VF016
+	{{ID0_SST, 0x26, 0x02}, 80},	// SST26VF032
+	{{ID0_SST, 0x26, 0x43}, 80},	// SST26VF064
+};
+
 //#define FLAG_32BIT_ADDR	0x01	// larger than 16 MByte address
 //#define FLAG_STATUS_CMD70	0x02	// requires special busy flag check
 //#define FLAG_DIFF_SUSPEND	0x04	// uses 2 different suspend commands
@@ -334,12 +609,14 @@ bool SerialFlashChip::ready()
 
 bool SerialFlashChip::begin(SPIClass& device, uint8_t pin)
 {
+	if (backend) return true;
 	SPIPORT = device;
 	return begin(pin);
 }
 
 bool SerialFlashChip::begin(uint8_t pin)
 {
+	if (backend) return true;
 	uint8_t id[5];
 	uint8_t f;
 	uint32_t size;
@@ -347,6 +624,9 @@ bool SerialFlashChip::begin(uint8_t pin)
 	cspin_basereg = PIN_TO_BASEREG(pin);
 	cspin_bitmask = PIN_TO_BITMASK(pin);
 	SPIPORT.begin();
+#ifdef SERIALFLASH_USE_DMA
+	SerialFlashDMA::begin();
+#endif
 	pinMode(pin, OUTPUT);
 	CSRELEASE();
 	readID(id);
@@ -386,6 +666,16 @@ bool SerialFlashChip::begin(uint8_t pin)
 		// Micron requires busy checks with a different command
 		f |= FLAG_STATUS_CMD70; // TODO: all or just multi-die chips?
 	}
+	// parts listed with their full ID read with FAST READ at their rated
+	// clock, everything else keeps READ (0x03) at the default 50 MHz
+	spiClock = 50000000;
+	for (uint8_t n = 0; n < sizeof(fastReadClocks) / sizeof(fastReadClocks[0]); n++) {
+		if (memcmp(id, fastReadClocks[n].id, 3) == 0) {
+			f |= FLAG_FAST_READ;
+			spiClock = (uint32_t)fastReadClocks[n].mhz * 1000000;
+			break;
+		}
+	}
 	flags = f;
 	readID(id);
 	return true;
@@ -395,7 +685,12 @@ bool SerialFlashChip::begin(uint8_t pin)
 //
 void SerialFlashChip::sleep()
 {
-	if (busy) wait();
+	if (backend) {
+		backend->sleep();
+		return;
+	}
+	DMAWAIT();
+	if (busy || QUEUED_PAGES) wait();
 	SPIPORT.beginTransaction(SPICONFIG);
 	CSASSERT();
 	SPIPORT.transfer(0xB9); // Deep power down command
@@ -404,6 +699,11 @@ void SerialFlashChip::sleep()
 
 void SerialFlashChip::wakeup()
 {
+	if (backend) {
+		backend->wakeup();
+		return;
+	}
+	DMAWAIT();
 	SPIPORT.beginTransaction(SPICONFIG);
 	CSASSERT();
 	SPIPORT.transfer(0xAB); // Wake up from deep power down command
@@ -412,6 +712,11 @@ void SerialFlashChip::wakeup()
 
 void SerialFlashChip::readID(uint8_t *buf)
 {
+	if (backend) {
+		backend->readID(buf);
+		return;
+	}
+	DMAWAIT();
 	if (busy) wait();
 	SPIPORT.beginTransaction(SPICONFIG);
 	CSASSERT();
@@ -430,6 +735,11 @@ void SerialFlashChip::readID(uint8_t *buf)
 
 void SerialFlashChip::readSerialNumber(uint8_t *buf) //needs room for 8 bytes
 {
+	if (backend) {
+		memset(buf, 0, 8);
+		return;
+	}
+	DMAWAIT();
 	if (busy) wait();
 	SPIPORT.beginTransaction(SPICONFIG);
 	CSASSERT();
@@ -472,8 +782,14 @@ uint32_t SerialFlashChip::blockSize()
 
 void SerialFlashChip::eraseSector(uint32_t addr)
 {
+	SERIALFLASH_STAT(sectorErases, 1);
+	if (backend) {
+		backend->eraseSector(addr);
+		return;
+	}
 	uint8_t f = flags;
-	if (busy) wait();
+	DMAWAIT();
+	if (busy || QUEUED_PAGES) wait();
 	SPIPORT.beginTransaction(SPICONFIG);
 	CSASSERT();
 	SPIPORT.transfer(0x06); // write enable command
@@ -490,6 +806,8 @@ void SerialFlashChip::eraseSector(uint32_t addr)
 	}
 	CSRELEASE();
 	SPIPORT.endTransaction();
+	eraseStart = addr & ~(uint32_t) 4095;
+	eraseEnd = eraseStart + 4096;
 	busy = 2;
 }
 
@@ -29,6 +29,27 @@
 #include <Arduino.h>
 #include <SPI.h>
 
+// Uncomment to move page programs and large reads to the SAMD21 DMAC
+//#define SERIALFLASH_USE_DMA
+// Uncomment to count flash operations and time the CustoFlash calls
+//#define SERIALFLASH_STATS
+// Uncomment to keep a trace of the latest CustoFlash calls in RAM
+//#define SERIALFLASH_TRACE
+
+#include "util/SerialFlash_dma.h"
+#include "util/SerialFlash_stats.h"
+#include "util/SerialFlash_trace.h"
+#include "SerialFlashBackend.h"
+
+// Number of 256 byte pages writeAsync() can hold before it has to wait (eg.
+// 4, 1 kB of RAM). With 0, writeAsync() is the same as write().
+#ifndef WRITE_QUEUE_SIZE
+#define WRITE_QUEUE_SIZE	0
+#endif
+#if WRITE_QUEUE_SIZE < 0 || WRITE_QUEUE_SIZE > 255
+#error "WRITE_QUEUE_SIZE must be between 0 and 255"
+#endif
+
 class SerialFlashChip
 {
 public:
@@ -44,14 +65,37 @@ public:
 	static bool ready();
 	static void wait();
 	static void write(uint32_t addr, const void *buf, uint32_t len);
+	static void writeAsync(uint32_t addr, const void *buf, uint32_t len);
 	static void eraseAll();
 	static void eraseBlock(uint32_t addr);
 	static void eraseSector(uint32_t addr);
+	static void onTransferComplete(void (*callback)());
+	static void setBackend(SerialFlashBackend *storage);
 private:
+	static SerialFlashBackend *backend;	// replaces the SPI chip when set
 	static uint8_t flags;	// chip features
+	static uint32_t spiClock;	// fastest clock for every command in use
 	static uint8_t busy;
 	// 0 = ready
 	// 1 = suspendable program operation
 	// 2 = suspendable erase operation
 	// 3 = busy for realz!!
+	static uint32_t eraseStart;	// area of the suspendable erase operation
+	static uint32_t eraseEnd;
+	static void suspendErase();
+	static void resumeErase();
+#if WRITE_QUEUE_SIZE > 0
+	struct QueuedPage {
+		uint32_t addr;
+		uint16_t len;
+		uint8_t data[256];
+	};
+	static QueuedPage writeQueue[WRITE_QUEUE_SIZE];	// pages not yet programmed
+	static uint8_t writeQueueHead;
+	static uint8_t writeQueueCount;
+#endif
+	static void waitBusy();
+	static void programPage(uint32_t addr, const uint8_t *p, uint32_t len, bool async);
+	static bool programQueuedPage();
+	static void transferDone();
 };
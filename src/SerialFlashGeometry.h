@@ -0,0 +1,105 @@
+#ifndef INCLUDE_SERIAL_FLASH_GEOMETRY
+#define INCLUDE_SERIAL_FLASH_GEOMETRY
+
+#include <inttypes.h>
+
+// Layout of a sector, from the end of the sector backwards:
+//   5 bytes of flags (record size, unsent and active flags, sector state)
+//   the written bits, one per record, l = ceil(n / 8) bytes
+//   the unsent bits, one per record, l bytes
+// and the records from the start of the sector, each a check byte followed by
+// the payload and programmed with it. Every offset only depends on
+// the sector size and the record size, so they are computed by the compiler
+// here instead of dividing at run time, which the Cortex-M0+ does in software.
+
+#define RECORD_HEADER_SIZE    1     //check byte in front of every record
+
+// Records of recordSize bytes that fit in a sector with their check bytes, two
+// state bits and the 5 bytes of flags
+constexpr uint16_t serialFlashCapacity(uint32_t sectorSize, uint8_t recordSize) {
+  return ((8 * sectorSize) - 47) / (2 + 8 * (RECORD_HEADER_SIZE + (uint32_t) recordSize));
+}
+
+template <uint16_t... I> struct SerialFlashIndexList {};
+
+template <uint16_t N, uint16_t... I>
+struct SerialFlashIndexRange : SerialFlashIndexRange<N - 1, N - 1, I...> {};
+
+template <uint16_t... I>
+struct SerialFlashIndexRange<0, I...> {
+  typedef SerialFlashIndexList<I...> type;
+};
+
+// Capacity of every record size, a 512 byte table in flash
+template <uint32_t SectorSize, typename Indices> struct SerialFlashCapacityTable;
+
+template <uint32_t SectorSize, uint16_t... I>
+struct SerialFlashCapacityTable<SectorSize, SerialFlashIndexList<I...> > {
+  static const uint16_t values[sizeof...(I)];
+};
+
+template <uint32_t SectorSize, uint16_t... I>
+const uint16_t SerialFlashCapacityTable<SectorSize, SerialFlashIndexList<I...> >::values[sizeof...(I)] = {
+  serialFlashCapacity(SectorSize, I)...
+};
+
+constexpr uint8_t serialFlashLog2(uint32_t n) {
+  return n <= 1 ? 0 : 1 + serialFlashLog2(n >> 1);
+}
+
+// Geometry of sectors of SectorSize bytes. The number of sectors is only
+// known at run time, from the chip ID or the partition.
+template <uint32_t SectorSize>
+class SerialFlashGeometry {
+
+  static_assert(SectorSize >= 256 && SectorSize <= 32768 && (SectorSize & (SectorSize - 1)) == 0,
+    "SectorSize must be a power of 2 between 256 and 32768");
+
+  typedef SerialFlashCapacityTable<SectorSize, typename SerialFlashIndexRange<256>::type> Capacities;
+
+public:
+  static constexpr uint8_t SECTOR_SHIFT = serialFlashLog2(SectorSize);
+  static constexpr uint16_t FLAGS_OFFSET = SectorSize - 5;    //record size and flags
+  static constexpr uint16_t STATE_OFFSET = SectorSize - 2;    //sector state
+  static constexpr uint16_t ACTIVE_OFFSET = SectorSize - 1;   //active flag
+
+  static constexpr uint32_t sectorAddress(uint16_t sectorIndex) {
+    return (uint32_t) sectorIndex << SECTOR_SHIFT;
+  }
+
+  static constexpr uint16_t sectorOffset(uint32_t addr) {
+    return addr & (SectorSize - 1);
+  }
+
+  // Start of record recordIndex, at its check byte
+  static constexpr uint32_t recordOffset(uint16_t recordIndex, uint8_t recordSize) {
+    return (uint32_t) recordIndex * (RECORD_HEADER_SIZE + recordSize);
+  }
+
+  // Bytes of written or unsent bits for n records
+  static constexpr uint16_t bitmapLength(uint16_t n) {
+    return (n + 7) >> 3;
+  }
+
+  static constexpr uint16_t writtenBitsOffset(uint16_t length) {
+    return SectorSize - (5 + length);
+  }
+
+  // Also where the records (or the end offset table) must stop
+  static constexpr uint16_t unsentBitsOffset(uint16_t length) {
+    return SectorSize - (5 + 2 * length);
+  }
+
+  // Same as serialFlashCapacity(), read from the table when recordSize is
+  // only known at run time
+  static uint16_t capacity(uint8_t recordSize) {
+    return Capacities::values[recordSize];
+  }
+};
+
+template <uint32_t S> constexpr uint8_t SerialFlashGeometry<S>::SECTOR_SHIFT;
+template <uint32_t S> constexpr uint16_t SerialFlashGeometry<S>::FLAGS_OFFSET;
+template <uint32_t S> constexpr uint16_t SerialFlashGeometry<S>::STATE_OFFSET;
+template <uint32_t S> constexpr uint16_t SerialFlashGeometry<S>::ACTIVE_OFFSET;
+
+#endif
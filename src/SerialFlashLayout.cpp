@@ -1,35 +1,139 @@
 #include "SerialFlashLayout.h"
 
+SectorDescriptor_t SerialFlashLayout::sectorTable[SECTOR_TABLE_SIZE];
+uint16_t SerialFlashLayout::partitionStart = 0;
+uint16_t SerialFlashLayout::partitionSectors = PARTITION_REST;
+uint16_t SerialFlashLayout::streamSectors = ((MAX_SECTOR - CHECKPOINT_RESERVED) / STREAM_COUNT) & ~7;
+bool SerialFlashLayout::geometryResolved = false;
+StreamState_t SerialFlashLayout::streams[STREAM_COUNT];
+uint8_t SerialFlashLayout::backlogSectors[(MAX_SECTOR + 7) / 8];
+#ifndef SECTOR_TABLE_LRU_SIZE
+uint8_t SerialFlashLayout::sectorTableLoaded[(MAX_SECTOR + 7) / 8];
+#else
+uint16_t SerialFlashLayout::sectorTableTags[SECTOR_TABLE_SIZE];
+uint16_t SerialFlashLayout::sectorTableStamps[SECTOR_TABLE_SIZE];
+uint16_t SerialFlashLayout::sectorTableClock = 0;
+#endif
+#ifdef MOUNT_CHECKPOINT
+uint16_t SerialFlashLayout::checkpointHeads[STREAM_COUNT];
+uint16_t SerialFlashLayout::checkpointTails[STREAM_COUNT];
+uint16_t SerialFlashLayout::checkpointCount = NO_SECTOR_DESCRIPTOR;
+#endif
+#if PRE_ERASE_BUFFER_SIZE > 0
+uint8_t SerialFlashLayout::heldRecords[PRE_ERASE_BUFFER_SIZE];
+#endif
+uint32_t SerialFlashLayout::heldAddress = 0;
+uint16_t SerialFlashLayout::heldLength = 0;
+uint8_t SerialFlashLayout::heldStream = 0;
+#ifdef PAGE_CACHE_SIZE
+uint8_t SerialFlashLayout::pageCache[PAGE_CACHE_SIZE][CACHE_PAGE_SIZE];
+uint32_t SerialFlashLayout::pageCacheTags[PAGE_CACHE_SIZE];
+uint16_t SerialFlashLayout::pageCacheStamps[PAGE_CACHE_SIZE];
+uint16_t SerialFlashLayout::pageCacheClock = 0;
+bool SerialFlashLayout::pageCacheAhead[PAGE_CACHE_SIZE];
+uint32_t SerialFlashLayout::recentPages[RECENT_PAGES];
+PageCacheStats_t SerialFlashLayout::pageCacheStats;
+#endif
+
 void SerialFlashLayout::init() {
+  //k, i and flags are kept while nothing outside of the layout touched the
+  //flash, invalidateSectorTable() drops the bitmap cache of every stream
+  if (mounted && k == streams[stream].bitmapSector) {
+    return;
+  }
   begin(DEVICE_SELECT, CHIP_PIN);
+  if (!geometryResolved) {
+    resolveGeometry();
+  }
+  if (streamSectors == 0) {
+    mounted = false;    //nothing is written outside of the partition
+    return;
+  }
+  uint16_t earliest = NO_SECTOR_DESCRIPTOR;   //earliest sector that may hold backlogs
+#ifdef MOUNT_CHECKPOINT
+  k = checkpointHead();
+  if (k == NO_ACTIVE_SECTOR) {
+    searchActiveSector();
+  } else if ((uint16_t) (checkpointTails[stream] - firstStreamSector()) < streamSectors) {
+    earliest = checkpointTails[stream];
+  }
+  checkpointHeads[stream] = k;
+#else
   searchActiveSector();
+#endif
   readSectorFlags();
   i = getNextRecordIndexForSector(k);
+  if (k != streams[stream].bitmapSector) {
+    loadBitmapCache(k);
+    recoverUncommittedRecords();
+  }
+  if (!streams[stream].backlogSummaryLoaded) {
+    loadBacklogSummary(earliest);
+  }
+  mounted = true;
 }
 
-void SerialFlashLayout::writeRecord(const void *record, uint8_t recordSize) {
+RecordAddress_t SerialFlashLayout::writeRecord(const void *record, uint8_t recordSize) {
+  RecordAddress_t written = {
+    .sectorIndex = INVALID_ADDRESS,
+    .recordIndex = INVALID_ADDRESS
+  };
+  if (recordSize == 0 || recordSize > MAX_PAYLOAD_SIZE) {
+    Serial.println(F("writeRecord ERROR: INVALID RECORD SIZE"));
+    return written;
+  }
+  if (streamSectors == 0) {
+    Serial.println(F("writeRecord ERROR: PARTITION TOO SMALL"));
+    return written;
+  }
+
+#ifdef VARIABLE_LENGTH_RECORDS
+  uint8_t sectorRecordSize = VARIABLE_RECORD_SIZE;
+#else
+  uint8_t sectorRecordSize = recordSize;
+#endif
   if (isBlankState(flags.active_flag)) {
-    activateBlankSector(recordSize);
+    activateBlankSector(sectorRecordSize);
   } else if (isActiveState(flags.active_flag)) {
-    if (flags.s != recordSize) {
+    if (flags.s != sectorRecordSize) {
       if (i == 0) {
-        reactivateCurrentSector(recordSize);
+        reactivateCurrentSector(sectorRecordSize);
       } else {
-        activateNextSector(recordSize);
+        activateNextSector(sectorRecordSize);
       }
+    } else if (!recordFits(recordSize)) {
+      activateNextSector(sectorRecordSize);
     }
   } else {
     // something wrong
     Serial.println(F("writeRecord ERROR: FILESYSTEM CORRUPTED"));
   }
 
-  uint32_t recordAddr = k * SECTOR_SIZE + i * flags.s;
-  write(recordAddr, record, recordSize);
+  written.sectorIndex = k;
+  written.recordIndex = i;
+  //the header and the payload go in the same program, so a record torn by a
+  //power loss fails its check byte at the next mount
+  uint8_t slot[VARIABLE_HEADER_SIZE + MAX_PAYLOAD_SIZE];
+  if (flags.s == VARIABLE_RECORD_SIZE) {
+    uint16_t offset = getDataEnd();
+    slot[0] = recordSize;
+    slot[1] = recordCheckByte(recordSize, (const uint8_t *) record, recordSize);
+    memcpy(slot + VARIABLE_HEADER_SIZE, record, recordSize);
+    writeRecordData(SectorGeometry::sectorAddress(k) + offset, slot, VARIABLE_HEADER_SIZE + recordSize);
+    appendRecordEnd(offset + VARIABLE_HEADER_SIZE + recordSize);
+  } else {
+    slot[0] = recordCheckByte(0, (const uint8_t *) record, recordSize);
+    memcpy(slot + RECORD_HEADER_SIZE, record, recordSize);
+    uint32_t recordAddr = SectorGeometry::sectorAddress(k) + SectorGeometry::recordOffset(i, flags.s);
+    writeRecordData(recordAddr, slot, RECORD_HEADER_SIZE + recordSize);
+  }
   incrementRecordIndex();
+  return written;
 }
 
 uint16_t SerialFlashLayout::readRecord(RecordAddress_t recordAddress, void *buf) {
-  if (recordAddress.sectorIndex >= MAX_SECTOR) {
+  flushHeldRecords();
+  if (!isPartitionSector(recordAddress.sectorIndex)) {
     Serial.println(F("readRecord ERROR: INVALID SECTOR INDEX"));
     return INVALID_ADDRESS;
   }
@@ -47,71 +151,195 @@ uint16_t SerialFlashLayout::readRecord(RecordAddress_t recordAddress, void *buf)
     }
   }
 
-  uint32_t recordAddr = recordAddress.sectorIndex * SECTOR_SIZE + recordAddress.recordIndex * temp.s;
+  uint32_t recordAddr = SectorGeometry::sectorAddress(recordAddress.sectorIndex)
+    + SectorGeometry::recordOffset(recordAddress.recordIndex, temp.s) + RECORD_HEADER_SIZE;
+  uint16_t recordSize = temp.s;
+  if (temp.s == VARIABLE_RECORD_SIZE) {
+    uint16_t ends[2];
+    readRecordEnds(recordAddress.sectorIndex, recordAddress.recordIndex, 1, ends);
+    recordAddr = SectorGeometry::sectorAddress(recordAddress.sectorIndex) + ends[0] + VARIABLE_HEADER_SIZE;
+    recordSize = payloadLength(ends, 0);
+  }
 
-  read(recordAddr, buf, temp.s);
-  return temp.s;
+  read(recordAddr, buf, recordSize);
+  return recordSize;
 }
 
 uint16_t SerialFlashLayout::readRecords(RecordAddress_t* recordAddresses, uint16_t length, void *buf) {
-  uint16_t recordSize;
+  return readRecords(recordAddresses, length, buf, NULL);
+}
 
+uint16_t SerialFlashLayout::readRecords(RecordAddress_t* recordAddresses, uint16_t length, void *buf, uint8_t *recordSizes) {
   uint8_t *data = (uint8_t *) buf;
+  uint16_t bytesRead = 0;
+  uint16_t j = 0;
+  flushHeldRecords();
+
+  while (j < length) {
+    RecordAddress_t first = recordAddresses[j];
+    SectorFlags_t temp = retrieveSectorFlag(first.sectorIndex);
+    uint16_t numberOfRecords = getNextRecordIndexForSector(first.sectorIndex);
+
+    if (isBlankState(temp.active_flag) || first.recordIndex >= numberOfRecords) {
+      Serial.println(F("readRecords ERROR: INVALID ADDRESS"));
+      if (recordSizes != NULL) {
+        recordSizes[j] = 0;
+      }
+      j++;
+      continue;
+    }
+
+    //extend the run while the next address is a neighbouring record of the same sector
+    int8_t step = 0;
+    uint16_t run = 1;
+    while (j + run < length && run < RECORD_RUN_LENGTH) {
+      RecordAddress_t next = recordAddresses[j + run];
+      int32_t delta = (int32_t) next.recordIndex - recordAddresses[j + run - 1].recordIndex;
+
+      if (next.sectorIndex != first.sectorIndex || next.recordIndex >= numberOfRecords) {
+        break;
+      }
+      if (step == 0 && (delta == 1 || delta == -1)) {
+        step = delta;
+      } else if (step == 0 || delta != step) {
+        break;
+      }
+      run++;
+    }
+
+    //one read per chunk of the run, latest-first runs are reordered in place
+    uint16_t lowest = step < 0 ? first.recordIndex - (run - 1) : first.recordIndex;
+    uint16_t ends[RECORD_RUN_LENGTH + 1];
+    uint8_t headerSize = RECORD_HEADER_SIZE;
+    if (temp.s == VARIABLE_RECORD_SIZE) {
+      readRecordEnds(first.sectorIndex, lowest, run, ends);
+      headerSize = VARIABLE_HEADER_SIZE;
+    } else {
+      for (uint16_t c = 0; c <= run; c++) {
+        ends[c] = SectorGeometry::recordOffset(lowest + c, temp.s);
+      }
+    }
+    uint16_t runBytes = readPayloads(first.sectorIndex, ends, run, headerSize, data + bytesRead);
+
+    if (step < 0) {
+      if (temp.s == VARIABLE_RECORD_SIZE) {
+        reverseVariableRecords(data + bytesRead, ends, run);
+      } else {
+        reverseRecords(data + bytesRead, run, temp.s);
+      }
+    }
+    if (recordSizes != NULL) {
+      for (uint16_t c = 0; c < run; c++) {
+        uint16_t r = step < 0 ? run - 1 - c : c;
+        recordSizes[j + c] = temp.s == VARIABLE_RECORD_SIZE ? payloadLength(ends, r) : temp.s;
+      }
+    }
 
-  for (int i = 0; i < length; i++) {
-    recordSize = readRecord(recordAddresses[i], (data + i*recordSize));
+    bytesRead += runBytes;
+    j += run;
   }
 
-  return (recordSize * length);
+  return bytesRead;
 }
 
 void SerialFlashLayout::markRecordSent(RecordAddress_t recordAddr) {
-  SectorFlags_t temp = retrieveSectorFlag(recordAddr.sectorIndex);
+  uint16_t recordsWritten = getNextRecordIndexForSector(recordAddr.sectorIndex);
 
-  uint16_t l = ceiling(temp.n, 8);                  // length of state bits in bytes
-  uint32_t a = recordAddr.sectorIndex * SECTOR_SIZE;           // sector start address
-  uint32_t addr = a + SECTOR_SIZE - (5 + (2 * l));  // record bits start address
-  uint16_t offset = recordAddr.recordIndex / 8;                // position byte offset
-  uint32_t byteAddress = addr + offset;             // position byte address
-  uint8_t bitPosition = recordAddr.recordIndex % 8;            // position of bit to program
+  if (recordAddr.recordIndex >= recordsWritten) {
+    Serial.println(F("markRecordSent ERROR: INVALID ADDRESS"));
+    return;
+  }
 
-  uint8_t buf;
-  read(byteAddress, &buf, 1);                       // replace with actual read
-  buf &= ~((1 << bitPosition) & 0xFF);              // set 0 at the bit position
-  write(byteAddress, &buf, 1);                      // replace with actual write
+  uint16_t offset = recordAddr.recordIndex / 8;     // position byte offset
+  uint8_t mask = 1 << (recordAddr.recordIndex % 8); // position of bit to program
+  clearUnsentBits(recordAddr.sectorIndex, offset, &mask, 1);
+}
 
-  if (!isActiveState(temp.active_flag) && !isBlankState(temp.active_flag)) {
-    uint16_t recordsWritten = getNextRecordIndexForSector(recordAddr.sectorIndex);
-    uint16_t lengthOfUsedBytes = ceiling(recordsWritten, 8);
+void SerialFlashLayout::markRecordsSent(RecordAddress_t* recordAddresses, uint16_t length) {
+  bool invalid = false;
 
-    if (lengthOfUsedBytes == 0) {
-      //nothing is written in this sector
-      return;
-    }
+  for (uint16_t j = 0; j < length; j++) {
+    uint16_t sectorIndex = recordAddresses[j].sectorIndex;
 
-    uint8_t unsentBitMask[lengthOfUsedBytes];
-    read(addr, &unsentBitMask, lengthOfUsedBytes);
+    //each sector is handled once, at its first address in the array
+    bool seen = false;
+    for (uint16_t p = 0; p < j && !seen; p++) {
+      seen = recordAddresses[p].sectorIndex == sectorIndex;
+    }
+    if (seen) {
+      continue;
+    }
 
-    uint8_t remainderBits = recordsWritten % CHAR_BIT;
-    uint8_t unusedBits = remainderBits == 0 ? 0 : CHAR_BIT - remainderBits;
+    uint16_t recordsWritten = getNextRecordIndexForSector(sectorIndex);
+    uint16_t lowest = NO_BACKLOG_RECORD;
+    uint16_t highest = 0;
+    for (uint16_t p = j; p < length; p++) {
+      uint16_t recordIndex = recordAddresses[p].recordIndex;
+      if (recordAddresses[p].sectorIndex != sectorIndex) {
+        continue;
+      }
+      if (recordIndex >= recordsWritten) {
+        invalid = true;
+        continue;
+      }
+      lowest = recordIndex < lowest ? recordIndex : lowest;
+      highest = recordIndex > highest ? recordIndex : highest;
+    }
 
-    if (remainderBits != 0) {
-      *(unsentBitMask + lengthOfUsedBytes - 1) &= ~((0xFF << remainderBits) & 0xFF); // set leading unused bits to 0
+    if (lowest == NO_BACKLOG_RECORD) {
+      continue;
     }
 
-    for (int i = 0; i < lengthOfUsedBytes; i++) {
-      if (unsentBitMask[i] != 0x00) {
-        return;
+    uint16_t firstByte = lowest / 8;
+    uint16_t span = highest / 8 - firstByte + 1;
+    uint8_t mask[span];
+    memset(mask, 0x00, span);
+    for (uint16_t p = j; p < length; p++) {
+      uint16_t recordIndex = recordAddresses[p].recordIndex;
+      if (recordAddresses[p].sectorIndex == sectorIndex && recordIndex < recordsWritten) {
+        mask[recordIndex / 8 - firstByte] |= 1 << (recordIndex % 8);
       }
     }
+    clearUnsentBits(sectorIndex, firstByte, mask, span);
+  }
 
-    markSectorSent(recordAddr.sectorIndex);
+  if (invalid) {
+    Serial.println(F("markRecordsSent ERROR: INVALID ADDRESS"));
   }
 }
 
-void SerialFlashLayout::markRecordsSent(RecordAddress_t* recordAddresses, uint16_t length) {
-  for (int i = 0; i < length; i++) {
-    markRecordSent(recordAddresses[i]);
+void SerialFlashLayout::markRangeSent(RecordAddress_t from, RecordAddress_t to) {
+  if (!isPartitionSector(from.sectorIndex) || !isPartitionSector(to.sectorIndex)
+    || streamState(from.sectorIndex) != streamState(to.sectorIndex)) {
+    Serial.println(F("markRangeSent ERROR: INVALID SECTOR INDEX"));
+    return;
+  }
+
+  uint16_t sectorIndex = from.sectorIndex;
+  uint16_t track = 0;
+
+  while (track < streamSectors) {
+    uint16_t recordsWritten = getNextRecordIndexForSector(sectorIndex);
+    uint16_t lowest = sectorIndex == from.sectorIndex ? from.recordIndex : 0;
+    uint16_t highest = sectorIndex == to.sectorIndex ? to.recordIndex : recordsWritten - 1;
+    highest = highest >= recordsWritten ? recordsWritten - 1 : highest;
+
+    if (recordsWritten > 0 && lowest <= highest && getSectorDescriptor(sectorIndex)->unsent > 0) {
+      //whole bytes inside the range, partial bytes at both ends
+      uint16_t firstByte = lowest / 8;
+      uint16_t span = highest / 8 - firstByte + 1;
+      uint8_t mask[span];
+      memset(mask, 0xFF, span);
+      SerialFlashBitmap::clearRange(mask, 0, lowest % 8);
+      SerialFlashBitmap::clearRange(mask, (span - 1) * 8 + highest % 8 + 1, span * 8);
+      clearUnsentBits(sectorIndex, firstByte, mask, span);
+    }
+
+    if (sectorIndex == to.sectorIndex) {
+      break;
+    }
+    sectorIndex = nextSector(sectorIndex);
+    track++;
   }
 }
 
@@ -128,7 +356,7 @@ void SerialFlashLayout::markLatestWrittenRecordSent() {
 uint16_t SerialFlashLayout::getLatestWrittenRecordSector() {
   if (i == 0) {
     //move to the previous sector
-    uint16_t sectorIndex = k < 1 ? SECTOR_SIZE - 1 : k - 1;
+    uint16_t sectorIndex = previousSector(k);
 
     SectorFlags_t temp = retrieveSectorFlag(sectorIndex);
 
@@ -156,53 +384,29 @@ uint16_t SerialFlashLayout::getLatestWrittenRecordIndex(uint16_t sectorIndex) {
 }
 
 uint16_t SerialFlashLayout::getEarliestBacklogSector() {
-  uint16_t seek_k = k + 1 >= MAX_SECTOR ? 0 : k + 1;
-  uint16_t track = 0;
-
-  while (track < MAX_SECTOR) {
-    uint32_t a = seek_k * SECTOR_SIZE;
-
-    uint32_t sectorStateAddr = a + (SECTOR_SIZE - 2);
-    SectorState_t sectorState;
-    read(sectorStateAddr, &sectorState, 2);
-
-    if (sectorState.active != sectorState.unsent) {
-      if (seek_k == k) {
-        uint16_t recordsWritten = getNextRecordIndexForSector(k);
-        return recordsWritten == 0 ? NO_BACKLOG_SECTOR : seek_k;
-      } else {
-        return seek_k;
-      }
-    }
-    seek_k++;
-
-    if (seek_k >= MAX_SECTOR) {
-      seek_k = 0;
-    }
-    track++;
+  //drop summary bits of sectors that turn out to have no unsent record
+  StreamState_t *state = &streams[stream];
+  while (state->backlogTail != NO_BACKLOG_SECTOR && getSectorDescriptor(state->backlogTail)->unsent == 0) {
+    clearBacklogSector(state->backlogTail);
   }
-  return BLANK_STATE;
+  return state->backlogTail;
 }
 
 uint16_t SerialFlashLayout::getEarliestBacklogIndex(uint16_t sectorIndex) {
   SectorFlags_t temp = retrieveSectorFlag(sectorIndex);
 
-  uint16_t l = ceiling(temp.n, 8);  // length of state bits in bytes
-  uint32_t a = sectorIndex * SECTOR_SIZE;             // sector start address
-  uint32_t addr = a + SECTOR_SIZE - (5 + (2 * l));      // record bits start address
-
   uint16_t recordsWritten = getNextRecordIndexForSector(sectorIndex);
-  uint16_t lengthOfUsedBytes = ceiling(recordsWritten, 8);
+  uint16_t lengthOfUsedBytes = SectorGeometry::bitmapLength(recordsWritten);
 
-  if (lengthOfUsedBytes == 0) {
+  if (lengthOfUsedBytes == 0 || isBlankState(temp.active_flag)) {
     //nothing is written in this sector
     return NO_BACKLOG_RECORD;
   }
 
   uint8_t buf[lengthOfUsedBytes];
-  read(addr, &buf, lengthOfUsedBytes);
+  readUnsentBits(sectorIndex, buf, lengthOfUsedBytes);
 
-  uint16_t pos = countTrailingZeroes(buf, lengthOfUsedBytes); // first set bit
+  uint16_t pos = SerialFlashBitmap::findFirstSet(buf, 0, recordsWritten);
 
   if (pos >= recordsWritten) {
     Serial.println(F("Filesystem corrupted"));
@@ -212,34 +416,11 @@ uint16_t SerialFlashLayout::getEarliestBacklogIndex(uint16_t sectorIndex) {
 }
 
 uint16_t SerialFlashLayout::getLatestBacklogSector() {
-  uint16_t recordsWritten = getNextRecordIndexForSector(k);
-  uint16_t prevSectorIndex = k < 1 ? MAX_SECTOR - 1 : k - 1;
-  int16_t seek_k = recordsWritten == 0 ? prevSectorIndex : k;
-  uint16_t track = 0;
-
-  while (track < MAX_SECTOR) {
-    uint32_t a = seek_k * SECTOR_SIZE;
-    uint32_t sectorStateAddr = a + (SECTOR_SIZE - 2);
-
-    SectorState_t sectorState;
-    read(sectorStateAddr, &sectorState, 2);
-
-    if (sectorState.active != sectorState.unsent) {
-      return seek_k;
-    }
-
-    if (isBlankState(sectorState.active)) {
-      break;
-    }
-
-    seek_k--;
-
-    if (seek_k < 0) {
-      seek_k = MAX_SECTOR - 1;
-    }
-    track++;
+  StreamState_t *state = &streams[stream];
+  while (state->backlogHead != NO_BACKLOG_SECTOR && getSectorDescriptor(state->backlogHead)->unsent == 0) {
+    clearBacklogSector(state->backlogHead);
   }
-  return NO_BACKLOG_SECTOR;
+  return state->backlogHead;
 }
 
 uint16_t SerialFlashLayout::getLatestBacklogIndex(uint16_t sectorIndex) {
@@ -247,12 +428,6 @@ uint16_t SerialFlashLayout::getLatestBacklogIndex(uint16_t sectorIndex) {
     return NO_BACKLOG_RECORD;
   }
 
-  SectorFlags_t temp = retrieveSectorFlag(sectorIndex);
-
-  uint16_t l = ceiling(temp.n, 8);                  // length of state bits in bytes
-  uint32_t a = sectorIndex * SECTOR_SIZE;           // sector start address
-  uint32_t addr = a + SECTOR_SIZE - (5 + (2 * l));  // unsent bits start address
-
   uint16_t recordsWritten = getNextRecordIndexForSector(sectorIndex);
 
   if (recordsWritten == 0) {
@@ -260,22 +435,16 @@ uint16_t SerialFlashLayout::getLatestBacklogIndex(uint16_t sectorIndex) {
     return NO_BACKLOG_RECORD;
   }
 
-  return nextLatestBacklogIndex(addr, recordsWritten);
+  return nextLatestBacklogIndex(sectorIndex, recordsWritten);
 }
 
 uint16_t SerialFlashLayout::getLatestBacklogIndex(uint16_t sectorIndex, uint16_t preceding) {
-  SectorFlags_t temp = retrieveSectorFlag(sectorIndex);
-
-  uint16_t l = ceiling(temp.n, 8);                  // length of state bits in bytes
-  uint32_t a = sectorIndex * SECTOR_SIZE;           // sector start address
-  uint32_t addr = a + SECTOR_SIZE - (5 + (2 * l));  // unsent bits start address
-
-  if (preceding == 0) {
+  if (preceding == 0 || preceding == NO_BACKLOG_RECORD) {
     //nothing is written in this sector
     return NO_BACKLOG_RECORD;
   }
 
-  return nextLatestBacklogIndex(addr, preceding);
+  return nextLatestBacklogIndex(sectorIndex, preceding);
 }
 
 uint16_t SerialFlashLayout::retrieveLatestBacklogsAddresses(uint8_t payloadSize, RecordAddress_t *addresses) {
@@ -284,21 +453,25 @@ uint16_t SerialFlashLayout::retrieveLatestBacklogsAddresses(uint8_t payloadSize,
 
   SectorFlags_t temp = retrieveSectorFlag(latestBacklogSector);
 
-  uint8_t totalRecordsSize = temp.s;
   uint16_t firstLatestBacklogSector = latestBacklogSector;
   uint16_t index = -1;
   bool terminate = latestBacklogSector == NO_BACKLOG_SECTOR || latestBacklogIndex == NO_BACKLOG_RECORD;
+  uint16_t totalRecordsSize = terminate ? 0 : temp.s;
+  if (!terminate && temp.s == VARIABLE_RECORD_SIZE) {
+    RecordAddress_t latest = { latestBacklogSector, latestBacklogIndex };
+    totalRecordsSize = getRecordSize(latest);
+  }
 
   while (totalRecordsSize <= payloadSize && !terminate) {
     index++;
     (addresses + index)->sectorIndex = latestBacklogSector;
     (addresses + index)->recordIndex = latestBacklogIndex;
-    totalRecordsSize += temp.s;
 
     latestBacklogIndex = getLatestBacklogIndex(latestBacklogSector, latestBacklogIndex);
 
     while (latestBacklogIndex == NO_BACKLOG_RECORD) {
-      latestBacklogSector = latestBacklogSector > 0 ? latestBacklogSector - 1 : MAX_SECTOR - 1;
+      latestBacklogSector = previousSector(latestBacklogSector);
+      SERIALFLASH_STAT(backlogScanSteps, 1);
       if (firstLatestBacklogSector == latestBacklogSector) {  // full cycle
         terminate = true;
         break;
@@ -312,10 +485,93 @@ uint16_t SerialFlashLayout::retrieveLatestBacklogsAddresses(uint8_t payloadSize,
 
       latestBacklogIndex = getLatestBacklogIndex(latestBacklogSector);
     }
+
+    if (temp.s == VARIABLE_RECORD_SIZE && !terminate) {
+      RecordAddress_t next = { latestBacklogSector, latestBacklogIndex };
+      totalRecordsSize += getRecordSize(next);
+    } else {
+      totalRecordsSize += temp.s;
+    }
   }
   return (index + 1);
 }
 
+uint16_t SerialFlashLayout::retrievePackedBacklogsAddresses(uint8_t payloadSize, RecordAddress_t *addresses, uint8_t *offsets) {
+  //latest backlogs first, of any size and from any sector of the stream. A
+  //record that does not fit in what is left is passed over for older ones.
+  uint16_t sectorIndex = getLatestBacklogSector();
+  uint16_t firstSector = sectorIndex;
+  uint16_t count = 0;
+  uint16_t used = 0;
+  uint16_t skipped = 0;
+
+  while (sectorIndex != NO_BACKLOG_SECTOR && used < payloadSize && skipped < PACK_SKIP_LIMIT) {
+    uint8_t recordSize = getRecordSizeForSector(sectorIndex);
+    if (recordSize != VARIABLE_RECORD_SIZE && recordSize > payloadSize - used) {
+      skipped++;                                    // nothing in this sector fits
+    } else {
+      uint16_t recordIndex = getLatestBacklogIndex(sectorIndex);
+      while (recordIndex != NO_BACKLOG_RECORD && used < payloadSize && skipped < PACK_SKIP_LIMIT) {
+        RecordAddress_t address = {
+          .sectorIndex = sectorIndex,
+          .recordIndex = recordIndex
+        };
+        uint8_t size = recordSize == VARIABLE_RECORD_SIZE ? getRecordSize(address) : recordSize;
+        if (size <= payloadSize - used) {
+          if (offsets != NULL) {
+            offsets[count] = used;
+          }
+          addresses[count++] = address;
+          used += size;
+        } else if (recordSize != VARIABLE_RECORD_SIZE) {
+          skipped++;                                // neither do the older ones
+          break;
+        } else {
+          skipped++;
+        }
+        recordIndex = getLatestBacklogIndex(sectorIndex, recordIndex);
+      }
+    }
+
+    sectorIndex = seekBacklogSector(sectorIndex, false);
+    if (sectorIndex == firstSector) {             // full cycle
+      break;
+    }
+  }
+  return count;
+}
+
+uint8_t SerialFlashLayout::getRecordSizeForSector(uint16_t sectorIndex) {
+  return retrieveSectorFlag(sectorIndex).s;
+}
+
+uint8_t SerialFlashLayout::getRecordSize(RecordAddress_t recordAddress) {
+  uint8_t recordSize = getRecordSizeForSector(recordAddress.sectorIndex);
+  if (recordSize != VARIABLE_RECORD_SIZE) {
+    return recordSize;
+  }
+
+  uint16_t ends[2];
+  readRecordEnds(recordAddress.sectorIndex, recordAddress.recordIndex, 1, ends);
+  return payloadLength(ends, 0);
+}
+
+bool SerialFlashLayout::isRecordSent(RecordAddress_t recordAddress) {
+  //the record's own unsent bit, a single byte read when the sector is not
+  //the cached one. Records that were never written count as sent
+  if (!isPartitionSector(recordAddress.sectorIndex)) {
+    return true;
+  }
+  SectorDescriptor_t *descriptor = getSectorDescriptor(recordAddress.sectorIndex);
+  if (recordAddress.recordIndex >= descriptor->written || descriptor->unsent == 0) {
+    return true;
+  }
+
+  uint8_t bits;
+  readUnsentBits(recordAddress.sectorIndex, &bits, recordAddress.recordIndex >> 3, 1);
+  return (bits & (1 << (recordAddress.recordIndex & 7))) == 0;
+}
+
 uint16_t SerialFlashLayout::getCurrentSectorIndex() {
   return k;
 }
@@ -324,6 +580,147 @@ uint16_t SerialFlashLayout::getNextRecordIndex() {
   return i;
 }
 
+SectorStats_t SerialFlashLayout::getSectorStats(uint16_t sectorIndex) {
+  //one descriptor lookup, a single tail read when it is not in RAM
+  SectorStats_t stats = { 0xFF, 0xFF, 0xFF, 0, 0, 0 };
+  if (!isPartitionSector(sectorIndex)) {
+    return stats;
+  }
+  SectorDescriptor_t *descriptor = getSectorDescriptor(sectorIndex);
+  stats.recordSize = descriptor->s;
+  stats.activeFlag = descriptor->active_flag;
+  stats.unsentFlag = descriptor->unsent_flag;
+  stats.capacity = descriptor->s == 0xFF ? 0 : capacityForRecordSize(descriptor->s);
+  stats.written = descriptor->written;
+  stats.unsent = descriptor->unsent;
+  return stats;
+}
+
+BacklogReport_t SerialFlashLayout::getBacklogReport() {
+  //the unsent count is kept up to date by writes, acks and erases once the
+  //first call after mounting has counted it
+  StreamState_t *state = &streams[stream];
+  if (state->unsentRecords == UNKNOWN_COUNT) {
+    state->unsentRecords = countUnsentRecords();
+  }
+
+  BacklogReport_t report;
+  uint16_t tail = getEarliestBacklogSector();
+  report.unsentRecords = state->unsentRecords;
+  report.backlogSectors = state->backlogSectorCount;
+  report.ringSectors = streamSectors;
+  if (tail == NO_BACKLOG_SECTOR) {
+    report.oldestBacklogAge = NO_BACKLOG_SECTOR;
+    report.freeSectors = streamSectors > 0 ? streamSectors - 1 : 0;
+    report.utilisation = 0;
+    return report;
+  }
+  uint16_t age = ((int32_t) k - tail + streamSectors) % streamSectors;
+  report.oldestBacklogAge = age;
+  report.freeSectors = streamSectors - 1 - age;
+  report.utilisation = (uint32_t) (age + 1) * 100 / streamSectors;
+  return report;
+}
+
+//Functions related to streams
+void SerialFlashLayout::setStream(uint8_t streamIndex) {
+  //call before init(), the instance then writes to this stream only
+  stream = streamIndex < STREAM_COUNT ? streamIndex : STREAM_COUNT - 1;
+  k = firstStreamSector();
+  i = 0;
+}
+
+uint8_t SerialFlashLayout::getStream() {
+  return stream;
+}
+
+uint16_t SerialFlashLayout::nextSector(uint16_t sectorIndex) {
+  //ring order within the stream holding sectorIndex
+  if (streamSectors == 0) {
+    return sectorIndex;
+  }
+  uint16_t first = sectorIndex - (sectorIndex - partitionStart) % streamSectors;
+  return sectorIndex + 1 >= first + streamSectors ? first : sectorIndex + 1;
+}
+
+uint16_t SerialFlashLayout::previousSector(uint16_t sectorIndex) {
+  if (streamSectors == 0) {
+    return sectorIndex;
+  }
+  uint16_t first = sectorIndex - (sectorIndex - partitionStart) % streamSectors;
+  return sectorIndex <= first ? first + streamSectors - 1 : sectorIndex - 1;
+}
+
+StreamState_t *SerialFlashLayout::streamState(uint16_t sectorIndex) {
+  //sectors outside of the streams are never used, they share the last state
+  uint16_t s = streamSectors > 0 ? (uint16_t) (sectorIndex - partitionStart) / streamSectors : 0;
+  return &streams[s < STREAM_COUNT ? s : STREAM_COUNT - 1];
+}
+
+uint16_t SerialFlashLayout::firstStreamSector() {
+  return partitionStart + (uint16_t) stream * streamSectors;
+}
+
+void SerialFlashLayout::setPartition(uint16_t firstSector, uint16_t sectorCount) {
+  //call before beginWork(), a sectorCount of 0 takes the rest of the chip.
+  //Streams start on a summary byte, so the partition is shrunk to the whole
+  //groups of 8 sectors inside the sectors given
+  flushBitmapCache();
+  uint32_t start = ((uint32_t) firstSector + 7) & ~7;
+  uint32_t end = ((uint32_t) firstSector + sectorCount) & ~7;
+  partitionStart = start < MAX_SECTOR ? start : MAX_SECTOR;
+  if (sectorCount == 0) {
+    partitionSectors = PARTITION_REST;
+  } else {
+    partitionSectors = end > start ? end - start : 0;
+  }
+  geometryResolved = false;
+  invalidateSectorTable();
+}
+
+uint16_t SerialFlashLayout::getPartitionStart() {
+  return partitionStart;
+}
+
+uint16_t SerialFlashLayout::getPartitionSectors() {
+  return partitionSectors != PARTITION_REST ? partitionSectors : 0;
+}
+
+uint16_t SerialFlashLayout::getStreamSectors() {
+  return streamSectors;
+}
+
+bool SerialFlashLayout::isPartitionSector(uint16_t sectorIndex) {
+  uint16_t count = partitionSectors < MAX_SECTOR - partitionStart ? partitionSectors : MAX_SECTOR - partitionStart;
+  return streamSectors != 0 && sectorIndex >= partitionStart && sectorIndex - partitionStart < count;
+}
+
+void SerialFlashLayout::resolveGeometry() {
+  //the chip size comes from its JEDEC ID, unknown chips keep MAX_SECTOR
+  uint8_t id[5];
+  readID(id);
+  uint32_t chipSectors = capacity(id) / SECTOR_SIZE;
+  if (chipSectors == 0 || chipSectors > MAX_SECTOR) {
+    chipSectors = MAX_SECTOR;
+  }
+  if (partitionStart > chipSectors) {
+    partitionStart = chipSectors;
+  }
+  if (partitionSectors > chipSectors - partitionStart) {
+    partitionSectors = chipSectors - partitionStart;
+  }
+
+  //a partition without room for 8 sectors per stream is not mounted
+  streamSectors = 0;
+  if (partitionSectors > CHECKPOINT_RESERVED) {
+    streamSectors = ((partitionSectors - CHECKPOINT_RESERVED) / STREAM_COUNT) & ~7;
+  }
+  if (streamSectors == 0) {
+    Serial.println(F("init ERROR: PARTITION TOO SMALL"));
+  }
+  geometryResolved = true;
+}
+
 //Functions related to states
 bool SerialFlashLayout::isBlankState(uint8_t flag) {
   return flag == 0xFF;    //0xFF means blank
@@ -351,43 +748,204 @@ uint8_t SerialFlashLayout::deactivateState(uint8_t flag) {
 
 //Functions related to flags
 void SerialFlashLayout::readSectorFlags() {
-  //retrive flags from flash memory to flags struct
-  uint32_t addr = (k + 1) * SECTOR_SIZE;
-  read(addr - 5, &flags, 5);
+  //retrive flags of the current sector to flags struct
+  flags = retrieveSectorFlag(k);
 }
 
 void SerialFlashLayout::setFlags(uint16_t recordSize, uint8_t unsentState, uint8_t activeState) {
   //set flags struct before writing the flags to the flash memory
   flags.s = recordSize;
-  if (flags.s == 0xFF) {
-    flags.n = 0xFFFF;
-  } else {
-    flags.n = ((8 * SECTOR_SIZE) - 47) / (2 * (1 + 4*flags.s));
-  }
+  flags.n = capacityForRecordSize(recordSize);
   flags.unsent_flag = unsentState;
   flags.active_flag = activeState;
 }
 
 uint8_t SerialFlashLayout::getActiveFlag(uint16_t sectorIndex) {
-  uint32_t flagAddr = (sectorIndex + 1) * SECTOR_SIZE - 1;
+  SectorDescriptor_t *descriptor = findSectorDescriptor(sectorIndex);
+  if (descriptor != NULL) {
+    return descriptor->active_flag;
+  }
+  if (sectorIndex == streamState(sectorIndex)->preErasedSector) {
+    return 0xFF;
+  }
+
+  uint32_t flagAddr = SectorGeometry::sectorAddress(sectorIndex) + SectorGeometry::ACTIVE_OFFSET;
   uint8_t flag;
   read(flagAddr, &flag, 1);
   return flag;
 }
 
 SectorFlags_t SerialFlashLayout::retrieveSectorFlag(uint16_t sectorIndex) {
-  SectorFlags_t sectorFlags;
-  uint32_t sectorAddress = (sectorIndex + 1) * SECTOR_SIZE - 5;
-  read(sectorAddress, &sectorFlags, 5);
+  SectorFlags_t sectorFlags = {
+    .n = 0xFFFF,
+    .s = 0xFF,
+    .unsent_flag = 0xFF,
+    .active_flag = 0xFF
+  };
+
+  if (!isPartitionSector(sectorIndex)) {
+    return sectorFlags;
+  }
+
+  SectorDescriptor_t *descriptor = getSectorDescriptor(sectorIndex);
+  sectorFlags.n = capacityForRecordSize(descriptor->s);
+  sectorFlags.s = descriptor->s;
+  sectorFlags.unsent_flag = descriptor->unsent_flag;
+  sectorFlags.active_flag = descriptor->active_flag;
   return sectorFlags;
 }
 
+uint16_t SerialFlashLayout::capacityForRecordSize(uint8_t recordSize) {
+  if (recordSize == 0xFF) {
+    return 0xFFFF;
+  }
+  if (recordSize == VARIABLE_RECORD_SIZE) {
+    return VARIABLE_RECORD_SLOTS;
+  }
+  return SectorGeometry::capacity(recordSize);
+}
+
+//Functions related to the sector descriptor table
+void SerialFlashLayout::loadSectorDescriptor(uint16_t sectorIndex, SectorDescriptor_t *descriptor) {
+  SectorFlags_t temp;
+  SERIALFLASH_STAT(descriptorLoads, 1);
+  uint32_t a = SectorGeometry::sectorAddress(sectorIndex);  // sector start address
+  StreamState_t *state = streamState(sectorIndex);
+  if (sectorIndex == state->preErasedSector) {
+    memset(&temp, 0xFF, 5);                         // may still be half erased
+  } else {
+    //the descriptor caches the tail, the page cache is skipped
+    SerialFlashChip::read(a + SectorGeometry::FLAGS_OFFSET, &temp, 5);
+  }
+
+  descriptor->s = temp.s;
+  descriptor->unsent_flag = temp.unsent_flag;
+  descriptor->active_flag = temp.active_flag;
+  descriptor->written = 0;
+  descriptor->unsent = 0;
+
+  uint16_t n = capacityForRecordSize(temp.s);
+  if (n == 0xFFFF) {
+    return;
+  }
+
+  uint16_t l = SectorGeometry::bitmapLength(n);  // length of state bits in bytes
+  uint8_t buf[2 * l];                               // unsent bits followed by record bits
+  if (sectorIndex == state->bitmapSector) {
+    memcpy(buf, state->bitmapCache, 2 * l);         // flash copy may be behind
+  } else {
+    SerialFlashChip::read(a + SectorGeometry::unsentBitsOffset(l), &buf, 2 * l);
+  }
+
+  uint16_t recordsWritten = SerialFlashBitmap::findFirstSet(buf + l, 0, l * CHAR_BIT);
+  descriptor->written = recordsWritten;
+  if (recordsWritten == 0 || recordsWritten > n) {
+    return;
+  }
+
+  descriptor->unsent = SerialFlashBitmap::countSet(buf, 0, recordsWritten);
+}
+
+SectorDescriptor_t *SerialFlashLayout::getSectorDescriptor(uint16_t sectorIndex) {
+  if (!isPartitionSector(sectorIndex)) {
+    //outside of the table, reads as blank and is never kept
+    static SectorDescriptor_t outside;
+    memset(&outside, 0xFF, 3);
+    outside.written = 0;
+    outside.unsent = 0;
+    return &outside;
+  }
+#ifndef SECTOR_TABLE_LRU_SIZE
+  //read on first use, so mounting does not read every sector tail
+  SectorDescriptor_t *descriptor = &sectorTable[sectorIndex];
+  uint8_t mask = 1 << (sectorIndex % CHAR_BIT);
+  if (!(sectorTableLoaded[sectorIndex / CHAR_BIT] & mask)) {
+    loadSectorDescriptor(sectorIndex, descriptor);
+    sectorTableLoaded[sectorIndex / CHAR_BIT] |= mask;
+  }
+  return descriptor;
+#else
+  SectorDescriptor_t *descriptor = findSectorDescriptor(sectorIndex);
+  if (descriptor != NULL) {
+    return descriptor;
+  }
+
+  uint16_t victim = 0;
+  for (uint16_t slot = 0; slot < SECTOR_TABLE_SIZE; slot++) {
+    if (sectorTableTags[slot] == 0) {
+      victim = slot;
+      break;
+    }
+    if ((uint16_t)(sectorTableClock - sectorTableStamps[slot]) > (uint16_t)(sectorTableClock - sectorTableStamps[victim])) {
+      victim = slot;
+    }
+  }
+
+  sectorTableTags[victim] = sectorIndex + 1;
+  sectorTableStamps[victim] = ++sectorTableClock;
+  loadSectorDescriptor(sectorIndex, &sectorTable[victim]);
+  return &sectorTable[victim];
+#endif
+}
+
+SectorDescriptor_t *SerialFlashLayout::findSectorDescriptor(uint16_t sectorIndex) {
+  //returns NULL when the descriptor is not in RAM, tags are stored as index + 1
+#ifndef SECTOR_TABLE_LRU_SIZE
+  if (sectorIndex >= MAX_SECTOR || !(sectorTableLoaded[sectorIndex / CHAR_BIT] & (1 << (sectorIndex % CHAR_BIT)))) {
+    return NULL;
+  }
+  return &sectorTable[sectorIndex];
+#else
+  for (uint16_t slot = 0; slot < SECTOR_TABLE_SIZE; slot++) {
+    if (sectorTableTags[slot] == sectorIndex + 1) {
+      sectorTableStamps[slot] = ++sectorTableClock;
+      return &sectorTable[slot];
+    }
+  }
+  return NULL;
+#endif
+}
+
+void SerialFlashLayout::invalidateSectorTable() {
+  //call after modifying the flash memory outside of the layout
+  for (uint8_t s = 0; s < STREAM_COUNT; s++) {
+    StreamState_t *state = &streams[s];
+    state->backlogSummaryLoaded = false;
+    state->backlogSectorCount = 0;
+    state->backlogTail = state->backlogHead = NO_BACKLOG_SECTOR;
+    state->unsentRecords = UNKNOWN_COUNT;
+    state->bitmapSector = NO_SECTOR_DESCRIPTOR;
+    state->bitmapDirtyStart = state->bitmapDirtyEnd = 0;
+    state->bitmapCommitStart = state->bitmapCommitEnd = 0;
+    state->preErasedSector = NO_SECTOR_DESCRIPTOR;
+    state->pendingCount = 0;
+  }
+  heldLength = 0;                                   // lost like the pending bits
+  memset(backlogSectors, 0, sizeof(backlogSectors));
+#ifndef SECTOR_TABLE_LRU_SIZE
+  memset(sectorTableLoaded, 0, sizeof(sectorTableLoaded));
+#else
+  memset(sectorTableTags, 0, sizeof(sectorTableTags));
+#endif
+#ifdef MOUNT_CHECKPOINT
+  checkpointCount = NO_SECTOR_DESCRIPTOR;
+#endif
+#ifdef PAGE_CACHE_SIZE
+  memset(pageCacheTags, 0, sizeof(pageCacheTags));
+  memset(recentPages, 0, sizeof(recentPages));
+#endif
+}
+
 //Functions related to sectors
 void SerialFlashLayout::searchActiveSector() {
-  uint16_t lower = 0;
-  uint16_t upper = MAX_SECTOR;
+  uint16_t lower = firstStreamSector();
+  uint16_t upper = lower + streamSectors;
   uint8_t lowerFlag = getActiveFlag(lower);
 
+  if (isBlankState(lowerFlag) && isActiveState(getActiveFlag(upper - 1))) {
+    k = upper - 1;        // the first sector was erased ahead of the last sector
+    return;
+  }
   if (isActiveState(lowerFlag) || isBlankState(lowerFlag)) {
     k = lower;
     return;
@@ -414,19 +972,19 @@ void SerialFlashLayout::searchActiveSector() {
     }
 
     round++;
-  } while ((1 << round) < MAX_SECTOR);
+  } while ((1 << round) < streamSectors);
 }
 
 void SerialFlashLayout::sequentialSearchActiveSector() {
   //Sequential search approach, TODO: Implement binary search
-  uint16_t seek_k = 0;
+  uint16_t seek_k = firstStreamSector();
 
   do {
-    uint32_t a = seek_k * SECTOR_SIZE;
-    uint32_t seek_addr = a + (SECTOR_SIZE - 1);
+    uint32_t a = SectorGeometry::sectorAddress(seek_k);
+    uint32_t seek_addr = a + SectorGeometry::ACTIVE_OFFSET;
 
     uint8_t flag;
-    read(seek_addr, &flag, 1);
+    SerialFlashChip::read(seek_addr, &flag, 1);   //once per mount, skips the page cache
 
     if (isActiveState(flag) || isBlankState(flag)) {
       k = seek_k;
@@ -434,9 +992,9 @@ void SerialFlashLayout::sequentialSearchActiveSector() {
     } else {
       seek_k++;
     }
-  } while (seek_k < MAX_SECTOR);
+  } while (seek_k < firstStreamSector() + streamSectors);
 
-  if (seek_k >= MAX_SECTOR) {
+  if (seek_k >= firstStreamSector() + streamSectors) {
     //something is very wrong
     Serial.println(F("The filesystem is corrupted."));
     return;
@@ -444,13 +1002,20 @@ void SerialFlashLayout::sequentialSearchActiveSector() {
 }
 
 void SerialFlashLayout::deactivateCurrentSector() {
-  uint32_t a = k * SECTOR_SIZE;
-  uint32_t addr = a + (SECTOR_SIZE - 1);
-  uint8_t flag;
-  read(addr, &flag, 1);
+  uint32_t a = SectorGeometry::sectorAddress(k);
+  uint32_t addr = a + SectorGeometry::ACTIVE_OFFSET;
+  uint8_t flag = getActiveFlag(k);
   if (isActiveState(flag)) {
     flag = deactivateState(flag);
     write(addr, &flag, 1);
+
+    SectorDescriptor_t *descriptor = getSectorDescriptor(k);
+    descriptor->active_flag = flag;
+
+    if (descriptor->written > 0 && descriptor->unsent == 0) {
+      //every record was sent while the sector was active
+      markSectorSent(k);
+    }
   } else {
     Serial.println(F("This flag is not active."));
     Serial.println(F("Deactivate current sector ERROR!"));
@@ -458,9 +1023,28 @@ void SerialFlashLayout::deactivateCurrentSector() {
 }
 
 void SerialFlashLayout::activateSector(uint16_t sector, SectorFlags_t sectorFlags) {
-  uint32_t a = sector * SECTOR_SIZE;
-  uint32_t addr = a + (SECTOR_SIZE - 5);
+  SERIALFLASH_STAT(sectorActivations, 1);
+  uint32_t a = SectorGeometry::sectorAddress(sector);
+  uint32_t addr = a + SectorGeometry::FLAGS_OFFSET;
   write(addr, &sectorFlags, 5);
+
+  //sector is either blank or freshly erased
+  resetBitmapCache(sector, SectorGeometry::bitmapLength(sectorFlags.n));
+
+  SectorDescriptor_t *descriptor = findSectorDescriptor(sector);
+  if (descriptor != NULL) {
+    descriptor->s = sectorFlags.s;
+    descriptor->unsent_flag = sectorFlags.unsent_flag;
+    descriptor->active_flag = sectorFlags.active_flag;
+    descriptor->written = 0;
+    descriptor->unsent = 0;
+  }
+  clearBacklogSector(sector);
+#ifdef MOUNT_CHECKPOINT
+  if (sector != checkpointHeads[stream]) {
+    writeCheckpoint();
+  }
+#endif
 }
 
 void SerialFlashLayout::activateBlankSector(uint8_t recordSize) {
@@ -470,97 +1054,810 @@ void SerialFlashLayout::activateBlankSector(uint8_t recordSize) {
 }
 
 void SerialFlashLayout::activateNextSector(uint8_t recordSize) {
+  flushBitmapCache();
+  uint8_t flag = getActiveFlag(k);
   deactivateCurrentSector();
-  k++;
-  if (k >= MAX_SECTOR) {
-    k = 0;
+  k = nextSector(k);
+  if (k == firstStreamSector()) {
+    flag = activateState(deactivateState(flag));  // next lap of the ring
   }
-  uint32_t a = k * SECTOR_SIZE;
-  uint32_t addr = a + (SECTOR_SIZE - 1);
-  uint8_t flag;
-  read(addr, &flag, 1);
-  eraseSector(a);
-  setFlags(recordSize, flags.unsent_flag, activateState(flag));
+  //the new sector takes the active flag of the current lap, so it does not
+  //depend on the flags of the sector being erased
+  uint32_t a = SectorGeometry::sectorAddress(k);
+  if (k != streams[stream].preErasedSector) {
+    dropUnsentRecords(k);
+    eraseSector(a);
+  }
+  streams[stream].preErasedSector = NO_SECTOR_DESCRIPTOR;
+  setFlags(recordSize, flags.unsent_flag, flag);
   activateSector(k, flags);
   i = 0;  // restart record index in new sector
 }
 
 void SerialFlashLayout::reactivateCurrentSector(uint8_t recordSize) {
   setFlags(recordSize, flags.unsent_flag, flags.active_flag);
-  uint32_t a = k * SECTOR_SIZE;
+  flushBitmapCache();
+  uint32_t a = SectorGeometry::sectorAddress(k);
+  dropUnsentRecords(k);
   eraseSector(a);
   activateSector(k, flags);
   i = 0;
 }
 
-//Functions related to record index
-void SerialFlashLayout::incrementRecordIndex() {
-  updateRecordPositionBit(i);
-  i++;                            // increment record index
-  if (i >= flags.n) {             // ensure record index doesn't exceed capacity
-  activateNextSector(flags.s);
-}
+void SerialFlashLayout::preEraseNextSector() {
+  uint16_t next = nextSector(k);
+  if (next == streams[stream].preErasedSector) {
+    return;
+  }
+
+  //the erase runs while records are written, reads and programs suspend it
+  SERIALFLASH_STAT(preErases, 1);
+  dropUnsentRecords(next);
+  eraseSector(SectorGeometry::sectorAddress(next));
+  streams[stream].preErasedSector = next;
+
+  SectorDescriptor_t *descriptor = findSectorDescriptor(next);
+  if (descriptor != NULL) {
+    descriptor->s = 0xFF;
+    descriptor->unsent_flag = 0xFF;
+    descriptor->active_flag = 0xFF;
+    descriptor->written = 0;
+    descriptor->unsent = 0;
+  }
+  clearBacklogSector(next);
 }
 
-uint16_t SerialFlashLayout::getNextRecordIndexForSector(uint16_t sectorIndex) {
-  SectorFlags_t temp = retrieveSectorFlag(sectorIndex);
+void SerialFlashLayout::writeRecordData(uint32_t addr, const uint8_t *data, uint16_t length) {
+#if PRE_ERASE_BUFFER_SIZE > 0
+  //a program would suspend the pre-erase, hold the record while it runs
+  bool erasing = streams[stream].preErasedSector != NO_SECTOR_DESCRIPTOR && !ready();
+  if (heldLength > 0 && (!erasing || heldStream != stream || addr != heldAddress + heldLength
+      || heldLength + length > PRE_ERASE_BUFFER_SIZE)) {
+    flushHeldRecords();
+  }
+  if (erasing && length <= PRE_ERASE_BUFFER_SIZE) {
+    if (heldLength == 0) {
+      heldAddress = addr;
+      heldStream = stream;
+    }
+    memcpy(heldRecords + heldLength, data, length);
+    heldLength += length;
+    return;
+  }
+#endif
+  write(addr, data, length);
+}
 
-  if (temp.n == 0xFFFF) {
-    return 0;
+void SerialFlashLayout::flushHeldRecords() {
+  //one program for the held records and one for their bits
+  if (heldLength == 0) {
+    return;
   }
+#if PRE_ERASE_BUFFER_SIZE > 0
+  uint16_t length = heldLength;
+  heldLength = 0;
+  write(heldAddress, heldRecords, length);
+  commitRecordBits(&streams[heldStream]);
+#endif
+}
 
-  uint32_t l = ceiling(temp.n, 8);            // length of state bits in bytes
-  uint32_t a = sectorIndex * SECTOR_SIZE;     // sector start address
-  uint32_t addr = a + SECTOR_SIZE - (5 + l);  // record bits start address
+#ifdef MOUNT_CHECKPOINT
+uint16_t SerialFlashLayout::checkpointSector() {
+  return partitionStart + partitionSectors - 1;
+}
 
-  uint8_t buf[l];                             // array to store record bits
-  read(addr, &buf, l);
+void SerialFlashLayout::loadCheckpoint() {
+  //entries are claimed by clearing their bit before they are programmed, the
+  //latest one is found from the bitmap at the start of the log sector
+  uint32_t a = SectorGeometry::sectorAddress(checkpointSector());
+  uint8_t bitmap[CHECKPOINT_BITMAP_LENGTH];
+  SerialFlashChip::read(a, bitmap, CHECKPOINT_BITMAP_LENGTH);
+  checkpointCount = SerialFlashBitmap::findFirstSet(bitmap, 0, CHECKPOINT_BITMAP_LENGTH * CHAR_BIT);
+  if (checkpointCount > CHECKPOINT_ENTRIES) {
+    checkpointCount = CHECKPOINT_ENTRIES;
+  }
 
-  uint16_t pos = countTrailingZeroes(buf, l); // first set bit
+  uint8_t entry[CHECKPOINT_ENTRY_SIZE];
+  memset(entry, 0xFF, CHECKPOINT_ENTRY_SIZE);
+  if (checkpointCount > 0) {
+    uint32_t entryAddr = a + CHECKPOINT_BITMAP_LENGTH + (uint32_t) (checkpointCount - 1) * CHECKPOINT_ENTRY_SIZE;
+    SerialFlashChip::read(entryAddr, entry, CHECKPOINT_ENTRY_SIZE);
+  }
+  bool valid = checkpointCount > 0 && entry[CHECKPOINT_ENTRY_SIZE - 1] == checkpointCheckByte(entry);
+  for (uint8_t s = 0; s < STREAM_COUNT; s++) {
+    checkpointHeads[s] = valid ? entry[4 * s] | (entry[4 * s + 1] << 8) : NO_ACTIVE_SECTOR;
+    checkpointTails[s] = valid ? entry[4 * s + 2] | (entry[4 * s + 3] << 8) : NO_SECTOR_DESCRIPTOR;
+  }
+}
 
-  if (pos > temp.n) {
-    Serial.println(F("ERROR: FILESYSTEM CORRUPTED"));
-    return CORRUPTED_FILESYSTEM;
+uint16_t SerialFlashLayout::checkpointHead() {
+  //a sector moved without its entry (power lost in between) is no longer active
+  if (checkpointCount == NO_SECTOR_DESCRIPTOR) {
+    loadCheckpoint();
   }
-  return pos;
+  uint16_t head = checkpointHeads[stream];
+  if (head < firstStreamSector() || head >= firstStreamSector() + streamSectors) {
+    return NO_ACTIVE_SECTOR;
+  }
+  uint8_t flag = getActiveFlag(head);
+  if (isBlankState(flag) && head == firstStreamSector()) {
+    return head;    //nothing written to the stream yet
+  }
+  if (!isActiveState(flag) || isActiveState(getActiveFlag(nextSector(head)))) {
+    return NO_ACTIVE_SECTOR;
+  }
+  return head;
 }
 
-void SerialFlashLayout::updateRecordPositionBit(uint16_t pos) {
-  uint16_t l = ceiling(flags.n, 8);           // length of state bits in bytes
-  uint32_t a = k * SECTOR_SIZE;               // sector start address
-  uint32_t addr = a + SECTOR_SIZE - (5 + l);  // record bits start address
-  uint16_t offset = pos / 8;                  // position byte offset
-  uint32_t byteAddress = addr + offset;       // position byte address
-  uint8_t bitPosition = pos % 8;              // position of bit to program
+void SerialFlashLayout::writeCheckpoint() {
+  if (checkpointCount == NO_SECTOR_DESCRIPTOR) {
+    loadCheckpoint();
+  }
+  checkpointHeads[stream] = k;
+  checkpointTails[stream] = streams[stream].backlogTail != NO_BACKLOG_SECTOR ? streams[stream].backlogTail : k;
+  uint32_t a = SectorGeometry::sectorAddress(checkpointSector());
+  if (checkpointCount >= CHECKPOINT_ENTRIES) {
+    eraseSector(a);
+    checkpointCount = 0;
+  }
+
+  uint8_t entry[CHECKPOINT_ENTRY_SIZE];
+  for (uint8_t s = 0; s < STREAM_COUNT; s++) {
+    entry[4 * s] = checkpointHeads[s] & 0xFF;
+    entry[4 * s + 1] = checkpointHeads[s] >> 8;
+    entry[4 * s + 2] = checkpointTails[s] & 0xFF;
+    entry[4 * s + 3] = checkpointTails[s] >> 8;
+  }
+  entry[CHECKPOINT_ENTRY_SIZE - 1] = checkpointCheckByte(entry);
+
+  //the bits of the earlier entries in the byte are already cleared, only the
+  //bit of this entry goes from 1 to 0
+  uint8_t claimed = (uint8_t) (0xFF << (checkpointCount % CHAR_BIT));
+  claimed &= ~(1 << (checkpointCount % CHAR_BIT));
+  write(a + checkpointCount / CHAR_BIT, &claimed, 1);
+  write(a + CHECKPOINT_BITMAP_LENGTH + (uint32_t) checkpointCount * CHECKPOINT_ENTRY_SIZE, entry, CHECKPOINT_ENTRY_SIZE);
+  checkpointCount++;
+}
+
+uint8_t SerialFlashLayout::checkpointCheckByte(const uint8_t *entry) {
+  //never matches a blank entry
+  uint8_t check = 0xA5;
+  for (uint8_t b = 0; b < CHECKPOINT_ENTRY_SIZE - 1; b++) {
+    check ^= entry[b];
+  }
+  return check;
+}
+#endif
+
+//Functions related to the active sector bitmap cache
+void SerialFlashLayout::loadBitmapCache(uint16_t sectorIndex) {
+  StreamState_t *state = streamState(sectorIndex);
+  if (sectorIndex == state->bitmapSector) {
+    return;
+  }
+
+  SectorFlags_t temp = retrieveSectorFlag(sectorIndex);
+  uint16_t l = SectorGeometry::bitmapLength(temp.n);  // length of state bits in bytes
+  if (isBlankState(temp.active_flag) || l > MAX_BITMAP_LENGTH) {
+    return;
+  }
+
+  flushStreamBitmap(state);
+  uint32_t a = SectorGeometry::sectorAddress(sectorIndex);
+  read(a + SectorGeometry::unsentBitsOffset(l), state->bitmapCache, 2 * l);
+  state->dataEnd = 0;
+  if (temp.s == VARIABLE_RECORD_SIZE) {
+    uint16_t recordsWritten = getNextRecordIndexForSector(sectorIndex);
+    uint16_t ends[2];
+    if (recordsWritten > 0 && recordsWritten <= temp.n) {
+      readRecordEnds(sectorIndex, recordsWritten - 1, 1, ends);
+      state->dataEnd = ends[1];
+    }
+  }
+  state->bitmapSector = sectorIndex;
+  state->bitmapLength = l;
+}
+
+void SerialFlashLayout::resetBitmapCache(uint16_t sectorIndex, uint16_t length) {
+  //the sector has just been activated, so both bitmaps are still erased
+  StreamState_t *state = streamState(sectorIndex);
+  flushStreamBitmap(state);
+  if (length > MAX_BITMAP_LENGTH) {
+    state->bitmapSector = NO_SECTOR_DESCRIPTOR;
+    return;
+  }
+  memset(state->bitmapCache, 0xFF, 2 * length);
+  state->dataEnd = 0;
+  state->bitmapSector = sectorIndex;
+  state->bitmapLength = length;
+}
+
+void SerialFlashLayout::flushBitmapCache() {
+  for (uint8_t s = 0; s < STREAM_COUNT; s++) {
+    flushStreamBitmap(&streams[s]);
+  }
+}
+
+void SerialFlashLayout::flushStreamBitmap(StreamState_t *state) {
+  //program the record bits and unsent bits changed since the last flush
+  commitRecordBits(state);
+  if (state->bitmapSector == NO_SECTOR_DESCRIPTOR || state->bitmapDirtyStart >= state->bitmapDirtyEnd) {
+    return;
+  }
+
+  uint32_t a = SectorGeometry::sectorAddress(state->bitmapSector);
+  uint32_t addr = a + SectorGeometry::unsentBitsOffset(state->bitmapLength);
+  SERIALFLASH_STAT(bitmapPrograms, 1);
+  write(addr + state->bitmapDirtyStart, state->bitmapCache + state->bitmapDirtyStart, state->bitmapDirtyEnd - state->bitmapDirtyStart);
+  state->bitmapDirtyStart = state->bitmapDirtyEnd = 0;
+}
+
+void SerialFlashLayout::readUnsentBits(uint16_t sectorIndex, uint8_t *buf, uint16_t length) {
+  readUnsentBits(sectorIndex, buf, 0, length);
+}
+
+void SerialFlashLayout::readUnsentBits(uint16_t sectorIndex, uint8_t *buf, uint16_t firstByte, uint16_t length) {
+  StreamState_t *state = streamState(sectorIndex);
+  if (sectorIndex == state->bitmapSector) {
+    memcpy(buf, state->bitmapCache + firstByte, length);
+    return;
+  }
+
+  SectorFlags_t temp = retrieveSectorFlag(sectorIndex);
+  uint16_t l = SectorGeometry::bitmapLength(temp.n);  // length of state bits in bytes
+  uint32_t a = SectorGeometry::sectorAddress(sectorIndex);
+  read(a + SectorGeometry::unsentBitsOffset(l) + firstByte, buf, length);
+}
+
+//Functions related to record index
+void SerialFlashLayout::incrementRecordIndex() {
+  updateRecordPositionBit(i);
+
+  SectorDescriptor_t *descriptor = findSectorDescriptor(k);
+  if (descriptor != NULL) {
+    descriptor->written = i + 1;
+    descriptor->unsent++;           // new records start unsent
+  }
+  setBacklogSector(k);
+  if (streams[stream].unsentRecords != UNKNOWN_COUNT) {
+    streams[stream].unsentRecords++;
+  }
+
+  i++;                            // increment record index
+  uint32_t used = i;
+  uint32_t capacity = flags.n;
+  if (flags.s == VARIABLE_RECORD_SIZE) {
+    //space left between the data and the offset table
+    used = getDataEnd() + 2 * i;
+    capacity = SectorGeometry::unsentBitsOffset(SectorGeometry::bitmapLength(flags.n));
+  }
+  if (i >= flags.n || !recordFits(1)) {   // ensure record index doesn't exceed capacity
+    activateNextSector(flags.s);
+  } else if (used * 100 >= capacity * PRE_ERASE_THRESHOLD) {
+    preEraseNextSector();
+  }
+}
+
+uint16_t SerialFlashLayout::getNextRecordIndexForSector(uint16_t sectorIndex) {
+  if (!isPartitionSector(sectorIndex)) {
+    return 0;
+  }
+
+  SectorDescriptor_t *descriptor = getSectorDescriptor(sectorIndex);
+  uint16_t pos = descriptor->written;         // first set bit of record bits
+
+  if (pos > capacityForRecordSize(descriptor->s)) {
+    Serial.println(F("ERROR: FILESYSTEM CORRUPTED"));
+    return CORRUPTED_FILESYSTEM;
+  }
+  return pos;
+}
+
+void SerialFlashLayout::updateRecordPositionBit(uint16_t pos) {
+  uint16_t l = SectorGeometry::bitmapLength(flags.n);  // length of state bits in bytes
+  uint32_t a = SectorGeometry::sectorAddress(k);  // sector start address
+  uint32_t addr = a + SectorGeometry::writtenBitsOffset(l);  // record bits start address
+  uint16_t offset = pos / 8;                  // position byte offset
+  uint32_t byteAddress = addr + offset;       // position byte address
+  uint8_t bitPosition = pos % 8;              // position of bit to program
 
   uint8_t buf;
+  StreamState_t *state = &streams[stream];
+  if (k == state->bitmapSector) {
+    //record bits are committed a group at a time, the payload is the only program
+    state->bitmapCache[l + offset] &= ~(1 << bitPosition);
+    if (state->bitmapCommitStart >= state->bitmapCommitEnd) {
+      state->bitmapCommitStart = offset;
+    }
+    state->bitmapCommitEnd = offset + 1;
+    //held records are committed when they are programmed, pending table
+    //entries only have room for one group
+    if (state->pendingCount == COMMIT_GROUP_SIZE || ((pos + 1) % COMMIT_GROUP_SIZE == 0 && !heldLength)) {
+      commitRecordBits(state);
+    }
+    return;
+  }
+
   read(byteAddress, &buf, 1);                 // replace with actual read
   buf &= ~(1 << bitPosition);                 // set 0 at the bit position
-  write(byteAddress, &buf, 1);                // replace with actual write
+  write(byteAddress, &buf, 1);
+}
+
+void SerialFlashLayout::commitRecordBits(StreamState_t *state) {
+  flushHeldRecords();                               // the records go before their bits
+  if (state->bitmapSector == NO_SECTOR_DESCRIPTOR || state->bitmapCommitStart >= state->bitmapCommitEnd) {
+    return;
+  }
+
+  if (state->pendingCount > 0) {
+    //offset table entries go first, so a committed record always has its end
+    uint16_t entries[COMMIT_GROUP_SIZE];
+    for (uint8_t p = 0; p < state->pendingCount; p++) {
+      entries[state->pendingCount - 1 - p] = state->pendingEnds[p];   // table grows down
+    }
+    uint16_t last = state->pendingFirst + state->pendingCount - 1;
+    write(recordEndAddress(state->bitmapSector, last), entries, 2 * state->pendingCount);
+    state->pendingCount = 0;
+  }
+
+  uint32_t a = SectorGeometry::sectorAddress(state->bitmapSector);
+  uint32_t addr = a + SectorGeometry::writtenBitsOffset(state->bitmapLength);  // record bits start address
+  uint8_t *bits = state->bitmapCache + state->bitmapLength;
+  SERIALFLASH_STAT(bitmapPrograms, 1);
+  write(addr + state->bitmapCommitStart, bits + state->bitmapCommitStart, state->bitmapCommitEnd - state->bitmapCommitStart);
+  state->bitmapCommitStart = state->bitmapCommitEnd = 0;
+}
+
+void SerialFlashLayout::recoverUncommittedRecords() {
+  //records written after the last commit hold data when power was lost before
+  //the group commit. They are marked written so the slots are never reused.
+  //Complete records stay unsent, a record torn mid-program fails its check
+  //byte and is marked sent so the data is never reported.
+  StreamState_t *state = &streams[stream];
+  if (k != state->bitmapSector || i >= flags.n) {
+    return;
+  }
+
+  uint8_t *bitmapCache = state->bitmapCache;
+  uint16_t l = state->bitmapLength;
+  uint16_t first = i;
+  uint16_t retired = flags.n;                   // first record retired as sent
+  if (flags.s == VARIABLE_RECORD_SIZE) {
+    i = recoverVariableRecords(first, &retired);
+  } else {
+    //held records may run past the next commit point, up to the first blank slot
+    uint8_t slot[RECORD_HEADER_SIZE + MAX_PAYLOAD_SIZE];
+    uint16_t slotSize = RECORD_HEADER_SIZE + flags.s;
+    for (uint16_t pos = first; pos < flags.n; pos++) {
+      uint32_t recordAddr = SectorGeometry::sectorAddress(k) + SectorGeometry::recordOffset(pos, flags.s);
+      read(recordAddr, slot, slotSize);
+
+      uint8_t bits = 0xFF;
+      for (uint16_t j = 0; j < slotSize; j++) {
+        bits &= slot[j];
+      }
+      if (bits == 0xFF) {
+        break;                                  // records are written in order
+      }
+      i = pos + 1;
+      if (slot[0] != recordCheckByte(0, slot + RECORD_HEADER_SIZE, flags.s)) {
+        retired = pos;                          // the program in progress
+        break;
+      }
+    }
+  }
+
+  for (uint16_t pos = first; pos < i; pos++) {
+    bitmapCache[l + pos / 8] &= ~(1 << (pos % 8));
+    if (pos >= retired) {
+      bitmapCache[pos / 8] &= ~(1 << (pos % 8));
+    }
+  }
+
+  if (i == first) {
+    return;
+  }
+
+  Serial.println(F("Recovered uncommitted records"));
+  uint32_t addr = SectorGeometry::sectorAddress(k) + SectorGeometry::unsentBitsOffset(l);
+  uint16_t start = first / 8;
+  uint16_t end = (i - 1) / 8 + 1;
+  write(addr + l + start, bitmapCache + l + start, end - start);
+  if (retired < i) {
+    start = retired / 8;
+    write(addr + start, bitmapCache + start, end - start);
+  }
+
+  uint16_t kept = (retired < i ? retired : i) - first;
+  SectorDescriptor_t *descriptor = findSectorDescriptor(k);
+  if (descriptor != NULL) {
+    descriptor->written = i;
+    descriptor->unsent += kept;
+  }
+  if (kept > 0) {
+    setBacklogSector(k);
+    if (state->unsentRecords != UNKNOWN_COUNT) {
+      state->unsentRecords += kept;
+    }
+  }
+
+  if (i >= flags.n || !recordFits(1)) {
+    activateNextSector(flags.s);
+  }
+}
+
+uint16_t SerialFlashLayout::recoverVariableRecords(uint16_t first, uint16_t *retired) {
+  //table entries are programmed before their record bits, so entries after
+  //the last committed record belong to whole records. Records written after
+  //the last entry are found from their headers and get their entry, up to
+  //the first torn one, which is retired. A torn entry retires the sector.
+  StreamState_t *state = &streams[stream];
+  uint16_t tableEnd = SectorGeometry::unsentBitsOffset(state->bitmapLength);
+  uint32_t a = SectorGeometry::sectorAddress(k);
+  uint16_t recordIndex = first;
+  uint16_t end = state->dataEnd;
+
+  while (recordIndex < flags.n) {
+    uint16_t entry;
+    read(recordEndAddress(k, recordIndex), &entry, 2);
+    if (entry == 0xFFFF) {
+      break;
+    }
+    if (entry < end || entry > tableEnd - 2 * (recordIndex + 1)) {
+      *retired = first;
+      return flags.n;
+    }
+    end = entry;
+    recordIndex++;
+  }
+
+  uint8_t slot[VARIABLE_HEADER_SIZE + MAX_PAYLOAD_SIZE];
+  while (recordIndex < flags.n && end + VARIABLE_HEADER_SIZE + 2 * (recordIndex + 1) <= tableEnd) {
+    uint16_t limit = tableEnd - 2 * (recordIndex + 1);   // below the entry of the record
+    read(a + end, slot, VARIABLE_HEADER_SIZE);
+    uint16_t recordEnd = end + VARIABLE_HEADER_SIZE + slot[0];
+    if (slot[0] > 0 && slot[0] <= MAX_PAYLOAD_SIZE && recordEnd <= limit) {
+      read(a + end + VARIABLE_HEADER_SIZE, slot + VARIABLE_HEADER_SIZE, slot[0]);
+      if (slot[1] == recordCheckByte(slot[0], slot + VARIABLE_HEADER_SIZE, slot[0])) {
+        write(recordEndAddress(k, recordIndex), &recordEnd, 2);
+        end = recordEnd;
+        recordIndex++;
+        continue;
+      }
+    }
+
+    //blank, or torn with its data ending at the last programmed byte of one record
+    if (limit > end + VARIABLE_HEADER_SIZE + MAX_PAYLOAD_SIZE) {
+      limit = end + VARIABLE_HEADER_SIZE + MAX_PAYLOAD_SIZE;
+    }
+    read(a + end, slot, limit - end);
+    uint16_t dataTop = end;
+    for (uint16_t b = 0; b < limit - end; b++) {
+      if (slot[b] != 0xFF) {
+        dataTop = end + b + 1;
+      }
+    }
+    if (dataTop == end) {
+      break;                                    // records are written in order
+    }
+    if (dataTop <= end + VARIABLE_HEADER_SIZE) {
+      dataTop = end + VARIABLE_HEADER_SIZE + 1 <= limit ? end + VARIABLE_HEADER_SIZE + 1 : limit;
+    }
+    write(recordEndAddress(k, recordIndex), &dataTop, 2);
+    *retired = recordIndex;
+    end = dataTop;
+    recordIndex++;
+    break;
+  }
+  state->dataEnd = end;
+  return recordIndex;
+}
+
+//Functions related to variable length records
+bool SerialFlashLayout::recordFits(uint8_t recordSize) {
+  if (i >= flags.n) {
+    return false;
+  }
+  if (flags.s != VARIABLE_RECORD_SIZE) {
+    return true;
+  }
+  //the record and its table entry must not meet
+  uint16_t tableEnd = SectorGeometry::unsentBitsOffset(SectorGeometry::bitmapLength(flags.n));
+  return (uint32_t) getDataEnd() + VARIABLE_HEADER_SIZE + recordSize + 2 * (i + 1) <= tableEnd;
+}
+
+uint16_t SerialFlashLayout::getDataEnd() {
+  StreamState_t *state = &streams[stream];
+  if (k == state->bitmapSector) {
+    return state->dataEnd;
+  }
+  if (i == 0) {
+    return 0;
+  }
+  uint16_t ends[2];
+  readRecordEnds(k, i - 1, 1, ends);
+  return ends[1];
+}
+
+void SerialFlashLayout::appendRecordEnd(uint16_t end) {
+  StreamState_t *state = &streams[stream];
+  if (k != state->bitmapSector) {
+    write(recordEndAddress(k, i), &end, 2);
+    return;
+  }
+  //programmed with the record bits by commitRecordBits()
+  if (state->pendingCount == 0) {
+    state->pendingFirst = i;
+  }
+  state->pendingEnds[state->pendingCount++] = end;
+  state->dataEnd = end;
+}
+
+void SerialFlashLayout::readRecordEnds(uint16_t sectorIndex, uint16_t first, uint16_t count, uint16_t *ends) {
+  //ends[0] is the start of record first, ends[c + 1] the end of record first + c.
+  //The entries are read into ends itself and put in record order, so the
+  //caller's count + 1 entries are the only buffer.
+  uint16_t previous = first > 0 ? 1 : 0;
+  uint16_t *entries = ends + 1 - previous;
+  read(recordEndAddress(sectorIndex, first + count - 1), entries, 2 * (count + previous));
+  for (uint16_t front = 0, back = count + previous - 1; front < back; front++, back--) {
+    uint16_t swap = entries[front];
+    entries[front] = entries[back];
+    entries[back] = swap;
+  }
+  if (previous == 0) {
+    ends[0] = 0;
+  }
+
+  StreamState_t *state = streamState(sectorIndex);
+  if (sectorIndex == state->bitmapSector) {
+    for (uint8_t p = 0; p < state->pendingCount; p++) {
+      uint16_t recordIndex = state->pendingFirst + p;
+      if (recordIndex + 1 >= first && recordIndex < first + count) {
+        ends[recordIndex + 1 - first] = state->pendingEnds[p];
+      }
+    }
+  }
+
+  //blank or torn entries read as empty records
+  uint16_t tableEnd = SectorGeometry::unsentBitsOffset(SectorGeometry::bitmapLength(VARIABLE_RECORD_SLOTS));
+  ends[0] = ends[0] > tableEnd ? tableEnd : ends[0];
+  for (uint16_t c = 1; c <= count; c++) {
+    if (ends[c] <= ends[c - 1] + VARIABLE_HEADER_SIZE || ends[c] > tableEnd
+        || ends[c] - ends[c - 1] > VARIABLE_HEADER_SIZE + MAX_PAYLOAD_SIZE) {
+      ends[c] = ends[c - 1];
+    }
+  }
+}
+
+uint32_t SerialFlashLayout::recordEndAddress(uint16_t sectorIndex, uint16_t recordIndex) {
+  //the offset table grows down from the bitmaps, one entry per record
+  uint16_t l = SectorGeometry::bitmapLength(VARIABLE_RECORD_SLOTS);
+  return SectorGeometry::sectorAddress(sectorIndex) + SectorGeometry::unsentBitsOffset(l) - 2 * (recordIndex + 1);
+}
+
+uint16_t SerialFlashLayout::payloadLength(const uint16_t *ends, uint16_t c) {
+  //record c of ends from readRecordEnds(), without its header
+  return ends[c + 1] > ends[c] ? ends[c + 1] - ends[c] - VARIABLE_HEADER_SIZE : 0;
+}
+
+uint16_t SerialFlashLayout::readPayloads(uint16_t sectorIndex, const uint16_t *ends, uint16_t count, uint8_t headerSize, uint8_t *payloads) {
+  //copies the payloads of records ends[0] to ends[count] back to back, one
+  //read per chunk of the run, the headers in between are dropped
+  uint8_t chunk[PAYLOAD_READ_CHUNK];
+  uint32_t a = SectorGeometry::sectorAddress(sectorIndex);
+  uint16_t chunkStart = 0;
+  uint16_t chunkEnd = 0;
+  uint16_t from = 0;                                // next byte to copy
+  uint16_t copied = 0;
+  for (uint16_t c = 0; c < count; ) {
+    uint16_t start = ends[c] + headerSize;
+    uint16_t stop = ends[c + 1];
+    if (stop <= start) {
+      c++;                                          // empty record
+      continue;
+    }
+    from = from > start ? from : start;
+    if (from >= chunkEnd) {
+      uint16_t length = ends[count] - from < PAYLOAD_READ_CHUNK ? ends[count] - from : PAYLOAD_READ_CHUNK;
+      read(a + from, chunk, length);
+      chunkStart = from;
+      chunkEnd = from + length;
+    }
+    uint16_t to = stop < chunkEnd ? stop : chunkEnd;
+    memcpy(payloads + copied, chunk + (from - chunkStart), to - from);
+    copied += to - from;
+    from = to;
+    if (from == stop) {
+      c++;
+    }
+  }
+  return copied;
+}
+
+void SerialFlashLayout::markBitmapDirty(StreamState_t *state, uint16_t start, uint16_t end) {
+  if (state->bitmapDirtyStart >= state->bitmapDirtyEnd) {
+    state->bitmapDirtyStart = start;
+    state->bitmapDirtyEnd = end;
+  } else {
+    state->bitmapDirtyStart = start < state->bitmapDirtyStart ? start : state->bitmapDirtyStart;
+    state->bitmapDirtyEnd = end > state->bitmapDirtyEnd ? end : state->bitmapDirtyEnd;
+  }
 }
 
 //Functions related to unsent sector and backlog
-uint16_t SerialFlashLayout::nextLatestBacklogIndex(uint32_t addr, uint16_t preceding) {
-  uint16_t lengthOfUsedBytes = ceiling(preceding, 8);
+void SerialFlashLayout::clearUnsentBits(uint16_t sectorIndex, uint16_t firstByte, uint8_t *mask, uint16_t length) {
+  //mask holds the bits of written records to mark sent, from unsent byte firstByte
+  SectorFlags_t temp = retrieveSectorFlag(sectorIndex);
+
+  uint16_t l = SectorGeometry::bitmapLength(temp.n);  // length of state bits in bytes
+  uint32_t a = SectorGeometry::sectorAddress(sectorIndex);  // sector start address
+  uint32_t addr = a + SectorGeometry::unsentBitsOffset(l);  // unsent bits start address
+
+  uint8_t buf[length];
+  StreamState_t *state = streamState(sectorIndex);
+  if (sectorIndex == state->bitmapSector) {
+    memcpy(buf, state->bitmapCache + firstByte, length);
+  } else {
+    read(addr + firstByte, buf, length);
+  }
+
+  uint16_t first = length;                          // first and last changed byte
+  uint16_t last = 0;
+  uint16_t cleared = 0;
+  for (uint16_t j = 0; j < length; j++) {
+    uint8_t hit = buf[j] & mask[j];
+    if (hit != 0x00) {
+      cleared += SerialFlashBitmap::countSet(&hit, 0, CHAR_BIT);
+      buf[j] &= ~hit;
+      first = first == length ? j : first;
+      last = j;
+    }
+  }
+
+  if (cleared > 0) {
+    if (state->unsentRecords != UNKNOWN_COUNT) {
+      state->unsentRecords -= cleared < state->unsentRecords ? cleared : state->unsentRecords;
+    }
+    if (sectorIndex == state->bitmapSector) {
+      //active sector, programmed on the next flush
+      memcpy(state->bitmapCache + firstByte + first, buf + first, last - first + 1);
+      markBitmapDirty(state, firstByte + first, firstByte + last + 1);
+    } else {
+      write(addr + firstByte + first, buf + first, last - first + 1);
+    }
+
+    SectorDescriptor_t *descriptor = findSectorDescriptor(sectorIndex);
+    if (descriptor != NULL) {
+      descriptor->unsent = cleared < descriptor->unsent ? descriptor->unsent - cleared : 0;
+      if (descriptor->unsent == 0) {
+        clearBacklogSector(sectorIndex);
+      }
+    }
+  }
+
+  if (!isActiveState(temp.active_flag) && !isBlankState(temp.active_flag) && isBlankState(temp.unsent_flag)) {
+    SectorDescriptor_t *descriptor = getSectorDescriptor(sectorIndex);
+
+    if (descriptor->written > 0 && descriptor->unsent == 0) {
+      markSectorSent(sectorIndex);
+    }
+  }
+}
+
+uint16_t SerialFlashLayout::nextLatestBacklogIndex(uint16_t sectorIndex, uint16_t preceding) {
+  uint16_t lengthOfUsedBytes = SectorGeometry::bitmapLength(preceding);
   uint8_t buf[lengthOfUsedBytes];
-  read(addr, &buf, lengthOfUsedBytes);
+  readUnsentBits(sectorIndex, buf, lengthOfUsedBytes);
+
+  return SerialFlashBitmap::findLastSetBefore(buf, preceding);   // last set bit, NO_BACKLOG_RECORD if none
+}
+
+void SerialFlashLayout::loadBacklogSummary(uint16_t earliest) {
+  //one pass over the sector states of the stream, starting after the active sector
+  StreamState_t *state = &streams[stream];
+  memset(backlogSectors + firstStreamSector() / CHAR_BIT, 0, streamSectors / CHAR_BIT);
+  state->backlogSectorCount = 0;
+  state->backlogTail = state->backlogHead = NO_BACKLOG_SECTOR;
+  state->unsentRecords = UNKNOWN_COUNT;
+
+  //with the earliest backlog sector known, the sectors from it to the active
+  //one are marked without reading them
+  if (earliest != NO_SECTOR_DESCRIPTOR) {
+    for (uint16_t seek_k = earliest; ; seek_k = nextSector(seek_k)) {
+      setBacklogSector(seek_k);
+      if (seek_k == k) {
+        break;
+      }
+    }
+    state->backlogSummaryLoaded = true;
+    return;
+  }
 
-  uint8_t remainderBits = preceding % CHAR_BIT;
-  uint8_t unusedBits = remainderBits == 0 ? 0 : CHAR_BIT - remainderBits;
+  uint16_t seek_k = k;
+  for (uint16_t track = 0; track < streamSectors; track++) {
+    seek_k = nextSector(seek_k);
+    SERIALFLASH_STAT(backlogScanSteps, 1);
 
-  if (remainderBits != 0) {
-    *(buf + lengthOfUsedBytes - 1) &= ~((0xFF << remainderBits) & 0xFF); // set leading unused bits to 0
+    SectorDescriptor_t *descriptor = findSectorDescriptor(seek_k);
+    if (descriptor != NULL) {
+      if (descriptor->unsent > 0) {
+        setBacklogSector(seek_k);
+      }
+      continue;
+    }
+
+    SectorState_t sectorState;
+    SerialFlashChip::read(SectorGeometry::sectorAddress(seek_k) + SectorGeometry::STATE_OFFSET, &sectorState, 2);   //skips the page cache
+    if (!isBlankState(sectorState.active) && sectorState.active != sectorState.unsent) {
+      setBacklogSector(seek_k);   //verified when it reaches the tail or head
+    }
   }
+  state->backlogSummaryLoaded = true;
+}
 
-  uint16_t lzExcludingUnusedBits = countLeadingZeroes(buf, lengthOfUsedBytes) - unusedBits;
+void SerialFlashLayout::setBacklogSector(uint16_t sectorIndex) {
+  uint8_t mask = 1 << (sectorIndex % CHAR_BIT);
+  if (backlogSectors[sectorIndex / CHAR_BIT] & mask) {
+    return;
+  }
+  backlogSectors[sectorIndex / CHAR_BIT] |= mask;
 
-  uint16_t pos = preceding - lzExcludingUnusedBits - 1; // last set bit
+  //sectors are only added at the write head
+  StreamState_t *state = streamState(sectorIndex);
+  if (state->backlogSectorCount++ == 0) {
+    state->backlogTail = sectorIndex;
+  }
+  state->backlogHead = sectorIndex;
+}
 
-  return pos;
+void SerialFlashLayout::clearBacklogSector(uint16_t sectorIndex) {
+  uint8_t mask = 1 << (sectorIndex % CHAR_BIT);
+  if (sectorIndex >= MAX_SECTOR || !(backlogSectors[sectorIndex / CHAR_BIT] & mask)) {
+    return;
+  }
+  backlogSectors[sectorIndex / CHAR_BIT] &= ~mask;
+
+  StreamState_t *state = streamState(sectorIndex);
+  if (--state->backlogSectorCount == 0) {
+    state->backlogTail = state->backlogHead = NO_BACKLOG_SECTOR;
+    return;
+  }
+  if (sectorIndex == state->backlogTail) {
+    state->backlogTail = seekBacklogSector(sectorIndex, true);
+  }
+  if (sectorIndex == state->backlogHead) {
+    state->backlogHead = seekBacklogSector(sectorIndex, false);
+  }
+}
+
+uint16_t SerialFlashLayout::seekBacklogSector(uint16_t sectorIndex, bool forward) {
+  //next set summary bit after sectorIndex in the ring order of its stream,
+  //wrapping around to sectorIndex itself
+  uint16_t first = sectorIndex - (sectorIndex - partitionStart) % streamSectors;
+  uint16_t end = first + streamSectors;
+  uint16_t found;
+
+  if (forward) {
+    found = SerialFlashBitmap::findFirstSet(backlogSectors, sectorIndex + 1, end);
+    if (found == end) {
+      found = SerialFlashBitmap::findFirstSet(backlogSectors, first, sectorIndex + 1);
+      found = found == sectorIndex + 1 ? NO_BACKLOG_SECTOR : found;
+    }
+  } else {
+    found = SerialFlashBitmap::findLastSet(backlogSectors, first, sectorIndex);
+    if (found == SERIALFLASH_NO_BIT) {
+      found = SerialFlashBitmap::findLastSet(backlogSectors, sectorIndex, end);
+    }
+    found = found == SERIALFLASH_NO_BIT ? NO_BACKLOG_SECTOR : found;
+  }
+  SERIALFLASH_STAT(backlogScanSteps, found == NO_BACKLOG_SECTOR ? streamSectors
+    : ((forward ? found - sectorIndex : sectorIndex - found) + streamSectors - 1) % streamSectors + 1);
+  return found;
 }
 
 void SerialFlashLayout::markSectorSent(uint16_t sectorIndex) {
-  uint32_t sectorStateAddr = (sectorIndex + 1) * SECTOR_SIZE - 2;
+  uint32_t sectorStateAddr = SectorGeometry::sectorAddress(sectorIndex) + SectorGeometry::STATE_OFFSET;
 
   SectorState_t sectorState;
   read(sectorStateAddr, &sectorState, 2);
@@ -568,37 +1865,270 @@ void SerialFlashLayout::markSectorSent(uint16_t sectorIndex) {
   if (isBlankState(sectorState.unsent)) {
     // write active flag value to unsent flag
     write(sectorStateAddr, &sectorState.active, 1);
+
+    SectorDescriptor_t *descriptor = findSectorDescriptor(sectorIndex);
+    if (descriptor != NULL) {
+      descriptor->unsent_flag = sectorState.active;
+    }
   } else {
     //something wrong
     Serial.println(F("Mark sector sent error!"));
   }
 }
 
-//Basic functions
-uint16_t SerialFlashLayout::ctz(uint8_t x) {
-  return x == 0 ? 8 : (uint16_t) LogTable256[x & (int8_t)(-x)];
+uint32_t SerialFlashLayout::countUnsentRecords() {
+  //one descriptor per backlog sector, from the earliest one; bits of
+  //sectors found to have no unsent record are dropped on the way
+  StreamState_t *state = &streams[stream];
+  uint32_t count = 0;
+  uint16_t sectorIndex = getEarliestBacklogSector();
+  for (uint16_t n = state->backlogSectorCount; n > 0 && sectorIndex != NO_BACKLOG_SECTOR; n--) {
+    uint16_t next = seekBacklogSector(sectorIndex, true);
+    uint16_t unsent = getSectorDescriptor(sectorIndex)->unsent;
+    if (unsent == 0) {
+      clearBacklogSector(sectorIndex);
+    }
+    count += unsent;
+    sectorIndex = next;
+  }
+  return count;
 }
 
-uint16_t SerialFlashLayout::clz(uint8_t x) {
-  return x == 0 ? 8 : (uint16_t) 7 - LogTable256[x];
+void SerialFlashLayout::dropUnsentRecords(uint16_t sectorIndex) {
+  //call before erasing a sector of the ring, its unsent records are lost
+  StreamState_t *state = streamState(sectorIndex);
+  if (state->unsentRecords == UNKNOWN_COUNT || !(backlogSectors[sectorIndex / CHAR_BIT] & (1 << (sectorIndex % CHAR_BIT)))) {
+    return;
+  }
+  uint16_t unsent = getSectorDescriptor(sectorIndex)->unsent;
+  state->unsentRecords -= unsent < state->unsentRecords ? unsent : state->unsentRecords;
 }
 
-uint16_t SerialFlashLayout::countTrailingZeroes(uint8_t* positionBytes, uint32_t length) {
-  uint8_t* ptr;
-  uint16_t i = 0;
-  for (ptr = positionBytes; i < length - 1 && *ptr == 0x00; ptr++, i++);
-  uint16_t pos = i * CHAR_BIT + ctz(*ptr);
-  return pos;
+//Functions related to the page cache
+#ifdef PAGE_CACHE_SIZE
+void SerialFlashLayout::read(uint32_t addr, void *buf, uint32_t len) {
+  if (len >= CACHE_PAGE_SIZE) {
+    pageCacheStats.bypasses++;
+    SerialFlashChip::read(addr, buf, len);
+    return;
+  }
+
+  uint8_t *data = (uint8_t *) buf;
+  while (len > 0) {
+    uint16_t offset = addr % CACHE_PAGE_SIZE;
+    uint32_t length = CACHE_PAGE_SIZE - offset;
+    if (length > len) {
+      length = len;
+    }
+    uint8_t *page = cachedPage(addr / CACHE_PAGE_SIZE);
+    if (page != NULL) {
+      memcpy(data, page + offset, length);
+    } else {
+      SerialFlashChip::read(addr, data, length);
+    }
+    addr += length;
+    data += length;
+    len -= length;
+  }
 }
 
-uint16_t SerialFlashLayout::countLeadingZeroes(uint8_t* positionBytes, uint32_t length) {
-  uint8_t* ptr;
-  uint16_t i = 0;
-  for (ptr = (positionBytes + length - 1); *ptr == 0x00 && i < length - 1; ptr--, i++);
-  uint16_t pos = i * CHAR_BIT + clz(*ptr);
-  return pos;
+void SerialFlashLayout::write(uint32_t addr, const void *buf, uint32_t len) {
+  SerialFlashChip::write(addr, buf, len);
+  updateCachedPages(addr, (const uint8_t *) buf, len);
 }
 
-uint16_t SerialFlashLayout::ceiling(uint16_t numerator, uint16_t denominator) {
-  return (numerator + denominator - 1) / denominator;
+void SerialFlashLayout::writeAsync(uint32_t addr, const void *buf, uint32_t len) {
+  SerialFlashChip::writeAsync(addr, buf, len);
+  updateCachedPages(addr, (const uint8_t *) buf, len);
+}
+
+void SerialFlashLayout::eraseAll() {
+  SerialFlashChip::eraseAll();
+  memset(pageCacheTags, 0, sizeof(pageCacheTags));
+}
+
+void SerialFlashLayout::eraseBlock(uint32_t addr) {
+  SerialFlashChip::eraseBlock(addr);
+  dropCachedPages(addr & ~(blockSize() - 1), blockSize());
+}
+
+void SerialFlashLayout::eraseSector(uint32_t addr) {
+  SerialFlashChip::eraseSector(addr);
+  dropCachedPages(addr & ~((uint32_t) SECTOR_SIZE - 1), SECTOR_SIZE);
+}
+
+const PageCacheStats_t &SerialFlashLayout::getPageCacheStats() {
+  return pageCacheStats;
+}
+
+void SerialFlashLayout::resetPageCacheStats() {
+  memset(&pageCacheStats, 0, sizeof(pageCacheStats));
+}
+
+uint8_t *SerialFlashLayout::cachedPage(uint32_t page) {
+  //returns NULL for a page read for the first time, it is only cached when it
+  //is read again or when it continues a scan of the latest pages read. The
+  //page after it in the scan direction is then read in the same transfer.
+  uint32_t tag = page + 1;
+  int8_t direction = 0;
+  bool again = false;
+  for (uint8_t r = 0; r < RECENT_PAGES; r++) {
+    if (recentPages[r] == 0) {
+      continue;
+    }
+    if (recentPages[r] == tag) {
+      again = true;
+    } else if (recentPages[r] == tag - 1) {
+      direction = 1;
+    } else if (recentPages[r] == tag + 1) {
+      direction = -1;
+    }
+  }
+  if (recentPages[0] != tag) {
+    memmove(recentPages + 1, recentPages, sizeof(recentPages) - sizeof(recentPages[0]));
+    recentPages[0] = tag;
+  }
+
+  uint8_t slot = pageCacheSlot(page);
+  if (slot < PAGE_CACHE_SIZE) {
+    pageCacheStamps[slot] = ++pageCacheClock;
+    pageCacheStats.hits++;
+    if (pageCacheAhead[slot]) {
+      pageCacheAhead[slot] = false;
+      pageCacheStats.readAheadHits++;
+    }
+    return pageCache[slot];
+  }
+  pageCacheStats.misses++;
+  if (!again && direction == 0) {
+    return NULL;
+  }
+
+  uint32_t ahead = page + direction;
+  const uint16_t pagesPerSector = SECTOR_SIZE / CACHE_PAGE_SIZE;
+  if (PAGE_CACHE_SIZE < 2 || ahead / pagesPerSector != page / pagesPerSector
+    || pageCacheSlot(ahead) < PAGE_CACHE_SIZE) {
+    direction = 0;
+  }
+  uint8_t pages = direction == 0 ? 1 : 2;
+  uint32_t first = direction < 0 ? ahead : page;
+  uint8_t victim = pageCacheVictim(pages);
+
+  //consecutive slots are contiguous, both pages are read at once
+  SerialFlashChip::read(first * CACHE_PAGE_SIZE, pageCache[victim], (uint32_t) pages * CACHE_PAGE_SIZE);
+  for (uint8_t p = 0; p < pages; p++) {
+    pageCacheTags[victim + p] = first + p + 1;
+    pageCacheStamps[victim + p] = ++pageCacheClock;
+    pageCacheAhead[victim + p] = first + p != page;
+  }
+  if (pages > 1) {
+    pageCacheStats.readAheads++;
+  }
+  return pageCache[victim + (page - first)];
+}
+
+uint8_t SerialFlashLayout::pageCacheSlot(uint32_t page) {
+  //returns PAGE_CACHE_SIZE when the page is not in RAM
+  for (uint8_t slot = 0; slot < PAGE_CACHE_SIZE; slot++) {
+    if (pageCacheTags[slot] == page + 1) {
+      return slot;
+    }
+  }
+  return PAGE_CACHE_SIZE;
+}
+
+uint8_t SerialFlashLayout::pageCacheVictim(uint8_t slots) {
+  //first of the consecutive slots whose most recently used page is the oldest
+  uint8_t victim = 0;
+  uint16_t victimAge = 0;
+  for (uint8_t slot = 0; slot + slots <= PAGE_CACHE_SIZE; slot++) {
+    uint16_t age = 0xFFFF;
+    for (uint8_t s = slot; s < slot + slots; s++) {
+      uint16_t pageAge = pageCacheTags[s] == 0 ? 0xFFFF : (uint16_t)(pageCacheClock - pageCacheStamps[s]);
+      if (pageAge < age) {
+        age = pageAge;
+      }
+    }
+    if (slot == 0 || age > victimAge) {
+      victim = slot;
+      victimAge = age;
+    }
+  }
+  return victim;
+}
+
+void SerialFlashLayout::updateCachedPages(uint32_t addr, const uint8_t *data, uint32_t len) {
+  //programming only clears bits, the cached copy stays equal to the chip
+  for (uint8_t slot = 0; slot < PAGE_CACHE_SIZE; slot++) {
+    if (pageCacheTags[slot] == 0) {
+      continue;
+    }
+    uint32_t start = (pageCacheTags[slot] - 1) * CACHE_PAGE_SIZE;
+    uint32_t from = addr > start ? addr : start;
+    uint32_t to = addr + len < start + CACHE_PAGE_SIZE ? addr + len : start + CACHE_PAGE_SIZE;
+    for (uint32_t a = from; a < to; a++) {
+      pageCache[slot][a - start] &= data[a - addr];
+    }
+  }
+}
+
+void SerialFlashLayout::dropCachedPages(uint32_t addr, uint32_t len) {
+  for (uint8_t slot = 0; slot < PAGE_CACHE_SIZE; slot++) {
+    uint32_t start = (pageCacheTags[slot] - 1) * CACHE_PAGE_SIZE;
+    if (pageCacheTags[slot] != 0 && start >= addr && start < addr + len) {
+      pageCacheTags[slot] = 0;
+    }
+  }
+}
+#endif
+
+//Basic functions
+void SerialFlashLayout::reverseRecords(uint8_t *records, uint16_t count, uint8_t recordSize) {
+  uint8_t *front = records;
+  uint8_t *back = records + (uint32_t) (count - 1) * recordSize;
+  for (; front < back; front += recordSize, back -= recordSize) {
+    for (uint8_t b = 0; b < recordSize; b++) {
+      uint8_t swap = front[b];
+      front[b] = back[b];
+      back[b] = swap;
+    }
+  }
+}
+
+void SerialFlashLayout::reverseBytes(uint8_t *bytes, uint16_t length) {
+  if (length < 2) {
+    return;
+  }
+  for (uint16_t front = 0, back = length - 1; front < back; front++, back--) {
+    uint8_t swap = bytes[front];
+    bytes[front] = bytes[back];
+    bytes[back] = swap;
+  }
+}
+
+void SerialFlashLayout::reverseVariableRecords(uint8_t *records, uint16_t *ends, uint16_t count) {
+  //reverse every byte, then each record back into reading order
+  uint16_t total = 0;
+  for (uint16_t c = 0; c < count; c++) {
+    total += payloadLength(ends, c);
+  }
+  reverseBytes(records, total);
+  uint8_t *record = records;
+  for (uint16_t c = count; c > 0; c--) {
+    uint16_t length = payloadLength(ends, c - 1);
+    reverseBytes(record, length);
+    record += length;
+  }
+}
+
+uint8_t SerialFlashLayout::recordCheckByte(uint8_t seed, const uint8_t *record, uint8_t recordSize) {
+  //CRC-8 (polynomial 0x07) of the payload, 0xFF is left to blank slots
+  uint8_t crc = seed;
+  for (uint8_t b = 0; b < recordSize; b++) {
+    crc ^= record[b];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+  return crc == 0xFF ? 0x00 : crc;
 }
@@ -3,7 +3,24 @@
 
 #include "SerialFlashChip.h"
 #define SECTOR_SIZE           4096
-#define MAX_SECTOR            512     //last sector index is 7,actual is 512
+// The ring covers the chip size decoded from its JEDEC ID by the first
+// beginWork(), or the partition given to setPartition(), up to MAX_SECTOR
+// sectors. MAX_SECTOR sizes the RAM tables: the backlog summary takes
+// MAX_SECTOR / 8 bytes and the sector table 8 * MAX_SECTOR bytes, so parts
+// larger than 2 MB need a larger MAX_SECTOR (eg. 4096 for 16 MB) together
+// with SECTOR_TABLE_LRU_SIZE.
+#ifndef MAX_SECTOR
+#define MAX_SECTOR            512
+#endif
+#if MAX_SECTOR < 8 || MAX_SECTOR > 65528
+#error "MAX_SECTOR must be between 8 and 65528"
+#endif
+
+#include "SerialFlashGeometry.h"
+#include "util/SerialFlash_bitmap.h"
+//Sector offsets of this build, see SerialFlashGeometry.h
+typedef SerialFlashGeometry<SECTOR_SIZE> SectorGeometry;
+
 #define CHAR_BIT              8
 #define NO_BACKLOG_SECTOR     (uint16_t) -1   //no latest or earliest backlog sector
 #define NO_BACKLOG_RECORD     (uint16_t) -1   //no latest or earliest backlog records in the sector
@@ -13,18 +30,131 @@
 #define NO_ACTIVE_SECTOR      (uint16_t) -1
 #define CORRUPTED_FILESYSTEM  (uint16_t) -1
 #define MAX_PAYLOAD_SIZE    	242
+#define NO_SECTOR_DESCRIPTOR  (uint16_t) -1   //descriptor slot not loaded from flash
+#define UNKNOWN_COUNT         (uint32_t) -1   //not counted since the last mount
+#define PARTITION_REST        (uint16_t) -1   //partition up to the end of the chip
+#define MAX_BITMAP_LENGTH     SectorGeometry::bitmapLength(serialFlashCapacity(SECTOR_SIZE, 1))   //bitmap length for 1 byte records
+
+// The sector descriptor table keeps the flags, written count and unsent count
+// of every sector in RAM (8 bytes per sector), each read from the flash the
+// first time its sector is looked at. On boards with little SRAM, define
+// SECTOR_TABLE_LRU_SIZE (eg. 16) to only keep the most recently used
+// descriptors instead.
+#ifdef SECTOR_TABLE_LRU_SIZE
+#define SECTOR_TABLE_SIZE     SECTOR_TABLE_LRU_SIZE
+#else
+#define SECTOR_TABLE_SIZE     MAX_SECTOR
+#endif
+
+// Record bits of the active sector are programmed once every
+// COMMIT_GROUP_SIZE records (and by flushBitmapCache()), so most records cost
+// the single page program of their check byte and payload. Records written
+// after the last commit are found again at the next mount: those whose check
+// byte matches are kept unsent, only a record torn by the power loss is
+// retired as sent. Set to 1 to program the bit before writeRecord() returns.
+#ifndef COMMIT_GROUP_SIZE
+#define COMMIT_GROUP_SIZE     8
+#endif
+#if COMMIT_GROUP_SIZE < 1 || COMMIT_GROUP_SIZE > 255
+#error "COMMIT_GROUP_SIZE must be between 1 and 255"
+#endif
+
+// The sector after the active one is erased in the background once the active
+// sector is PRE_ERASE_THRESHOLD percent full, so the rollover only writes the
+// new sector flags. Set to 100 to erase at the rollover instead.
+#ifndef PRE_ERASE_THRESHOLD
+#define PRE_ERASE_THRESHOLD   75
+#endif
+
+// Records written while that erase runs are held in a RAM buffer of
+// PRE_ERASE_BUFFER_SIZE bytes (by default the part of the sector written after
+// the threshold) and programmed with their record bits once the erase has
+// finished, the buffer is full or the sector is left, so the erase is
+// suspended once per buffer instead of once per record. Held records are lost
+// with the power, endWork() programs them. Set to 0 to program every record
+// at once.
+#ifndef PRE_ERASE_BUFFER_SIZE
+#define PRE_ERASE_BUFFER_SIZE ((SECTOR_SIZE * (100 - PRE_ERASE_THRESHOLD)) / 100)
+#endif
+
+// Records go to STREAM_COUNT independent logs, each with its own active
+// sector, record size and backlog, so interleaving records of different sizes
+// does not start a new sector at every write. Each stream is a ring of
+// getStreamSectors() sectors (a multiple of 8) in its own part of the
+// partition. Changing it requires erasing the chip.
+#ifndef STREAM_COUNT
+#define STREAM_COUNT          1
+#endif
+
+// Define MOUNT_CHECKPOINT to log the active sector and the earliest backlog
+// sector of every stream in the last sector of the partition each time a
+// stream moves, so beginWork() after a power cycle reads the latest entry of
+// the log instead of searching for the active sectors and reading the state
+// of every sector. The log sector is taken out of the rings, and is erased
+// when full. Changing it requires erasing the chip.
+#ifdef MOUNT_CHECKPOINT
+#define CHECKPOINT_RESERVED   1
+#define CHECKPOINT_ENTRY_SIZE (4 * STREAM_COUNT + 1)   //sectors of every stream and a check byte
+#define CHECKPOINT_ENTRIES    ((8 * (SECTOR_SIZE - 5)) / (8 * CHECKPOINT_ENTRY_SIZE + 1))
+#define CHECKPOINT_BITMAP_LENGTH  ((CHECKPOINT_ENTRIES + 7) / 8)
+#else
+#define CHECKPOINT_RESERVED   0
+#endif
+#if STREAM_COUNT < 1 || STREAM_COUNT > MAX_SECTOR / 8
+#error "STREAM_COUNT must be between 1 and MAX_SECTOR / 8"
+#endif
+
+// Define VARIABLE_LENGTH_RECORDS to start sectors that hold records of any
+// size up to MAX_PAYLOAD_SIZE, packed back to back. Such sectors have a record
+// size of VARIABLE_RECORD_SIZE and keep the end offset of every record in a
+// table below the bitmaps, so their capacity is VARIABLE_RECORD_SLOTS records
+// of VARIABLE_RECORD_MIN_SIZE bytes, or fewer when records are larger.
+// Each record starts with its length and a check byte. A record costs the
+// program of its header and payload, and each group of COMMIT_GROUP_SIZE
+// records one program of table entries and one of record bits (3 programs per
+// record with a group of 1). Sectors of either kind are read whether or not
+// the option is defined.
+#define VARIABLE_RECORD_SIZE  0
+#define VARIABLE_HEADER_SIZE  2     //length and check byte of variable length records
+#ifndef VARIABLE_RECORD_MIN_SIZE
+#define VARIABLE_RECORD_MIN_SIZE  4
+#endif
+#if VARIABLE_RECORD_MIN_SIZE < 1
+#error "VARIABLE_RECORD_MIN_SIZE must be at least 1"
+#endif
+#define VARIABLE_RECORD_SLOTS (((8 * SECTOR_SIZE) - 47) / (2 + 8 * (2 + VARIABLE_HEADER_SIZE + VARIABLE_RECORD_MIN_SIZE)))
+
+// readRecords() reads runs of neighbouring records RECORD_RUN_LENGTH records
+// at a time, so their offset table entries take a fixed 66 bytes of stack, and
+// the payloads through a PAYLOAD_READ_CHUNK byte buffer that drops the headers.
+#define RECORD_RUN_LENGTH     32
+#define PAYLOAD_READ_CHUNK    128
+
+// retrievePackedBacklogsAddresses() passes over backlogs that do not fit in
+// what is left of the payload, looking for older ones that do. It gives up
+// after PACK_SKIP_LIMIT records or sectors have been passed over.
+#ifndef PACK_SKIP_LIMIT
+#define PACK_SKIP_LIMIT       16
+#endif
+
+// Define PAGE_CACHE_SIZE (eg. 4) to keep that many 256 byte pages of the chip
+// in RAM. Reads shorter than a page (sector tails, offset tables, records) are
+// served from RAM once their page has been read twice, and when consecutive
+// pages of a sector are read in either direction the next page is read
+// together with the missing one. Writes update the cached pages and erases
+// drop them. Flash modified outside of the layout must be followed by
+// invalidateSectorTable().
+#define CACHE_PAGE_SIZE       256
+#define RECENT_PAGES          4
+#ifdef PAGE_CACHE_SIZE
+#if PAGE_CACHE_SIZE < 1 || PAGE_CACHE_SIZE > 255
+#error "PAGE_CACHE_SIZE must be between 1 and 255"
+#endif
+#endif
 
 #define DEVICE_SELECT					SPI1
 #define CHIP_PIN							32
 
-static const char LogTable256[256] =
-{
-	#define LT(n) n, n, n, n, n, n, n, n, n, n, n, n, n, n, n, n
-	0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
-	LT(4), LT(5), LT(5), LT(6), LT(6), LT(6), LT(6),
-	LT(7), LT(7), LT(7), LT(7), LT(7), LT(7), LT(7), LT(7)
-};
-
 typedef struct SectorFlags {
 	uint16_t n;           // maximum number of records that can be stored in this sector
 	uint8_t s;            // record size for this sector
@@ -37,6 +167,67 @@ typedef struct SectorState {
 	uint8_t active;
 } SectorState_t;
 
+typedef struct SectorDescriptor {
+	uint8_t s;            // record size for this sector
+	uint8_t unsent_flag;  // unsent flag of the sector
+	uint8_t active_flag;  // active flag of the sector
+	uint16_t written;     // number of records written in the sector
+	uint16_t unsent;      // number of written records that are unsent
+} SectorDescriptor_t;
+
+typedef struct StreamState {
+	//RAM copy of the active sector bitmaps, unsent bits followed by record bits
+	uint8_t bitmapCache[2 * MAX_BITMAP_LENGTH];
+	uint16_t bitmapSector = NO_SECTOR_DESCRIPTOR;
+	uint16_t bitmapLength = 0;
+	uint16_t bitmapDirtyStart = 0;
+	uint16_t bitmapDirtyEnd = 0;
+	uint16_t bitmapCommitStart = 0;   //record bits not yet programmed
+	uint16_t bitmapCommitEnd = 0;
+	//Backlog summary bounds, the bits are shared by every stream
+	uint16_t backlogSectorCount = 0;
+	uint16_t backlogTail = NO_BACKLOG_SECTOR;   //earliest backlog sector
+	uint16_t backlogHead = NO_BACKLOG_SECTOR;   //latest backlog sector
+	bool backlogSummaryLoaded = false;
+	uint32_t unsentRecords = UNKNOWN_COUNT;   //counted by the first getBacklogReport()
+	//Sector erased ahead of the write head
+	uint16_t preErasedSector = NO_SECTOR_DESCRIPTOR;
+	//Offset table of the cached sector when it holds variable length records,
+	//entries are programmed together with the record bits
+	uint16_t dataEnd = 0;             //end of the last written record
+	uint16_t pendingEnds[COMMIT_GROUP_SIZE];
+	uint16_t pendingFirst = 0;        //record index of pendingEnds[0]
+	uint8_t pendingCount = 0;
+} StreamState_t;
+
+typedef struct PageCacheStats {
+  uint32_t hits;          // pages read from RAM
+  uint32_t misses;        // pages read from the chip
+  uint32_t readAheads;    // pages read ahead of a scan
+  uint32_t readAheadHits; // pages read ahead and then read
+  uint32_t bypasses;      // reads of a page or more sent to the chip
+} PageCacheStats_t;
+
+// Counts of a sector, from its descriptor
+typedef struct SectorStats {
+  uint8_t recordSize;     // 0xFF when blank, VARIABLE_RECORD_SIZE for records of any size
+  uint8_t activeFlag;
+  uint8_t unsentFlag;
+  uint16_t capacity;      // records that fit, 0 when blank
+  uint16_t written;
+  uint16_t unsent;
+} SectorStats_t;
+
+// Backlog of a stream, see getBacklogReport()
+typedef struct BacklogReport {
+  uint32_t unsentRecords;     // records not marked sent
+  uint16_t backlogSectors;    // sectors holding unsent records
+  uint16_t oldestBacklogAge;  // sectors from the earliest backlog sector to the active one, NO_BACKLOG_SECTOR without backlog
+  uint16_t freeSectors;       // sectors that can be started before unsent records are erased
+  uint16_t ringSectors;       // sectors of the stream
+  uint8_t utilisation;        // percent of the ring from the earliest backlog sector to the active one
+} BacklogReport_t;
+
 typedef struct RecordAddress {
 	uint16_t sectorIndex;
 	uint16_t recordIndex;
@@ -54,14 +245,61 @@ private:
 
 	uint16_t k = 0;     //sector index
 	uint16_t i = 0;     //record index
+	uint8_t stream = 0; //stream written by this instance
+	bool mounted = false;
+
+	//Sector descriptor table, shared by every layout instance
+	static SectorDescriptor_t sectorTable[SECTOR_TABLE_SIZE];
+	//Ring geometry, resolved by the first init() after setPartition()
+	static uint16_t partitionStart;
+	static uint16_t partitionSectors;   //PARTITION_REST until resolved, 0 when empty
+	static uint16_t streamSectors;      //0 when the partition is too small
+	static bool geometryResolved;
+	//Bitmap cache, backlog bounds and pre-erased sector of every stream
+	static StreamState_t streams[STREAM_COUNT];
+	//Backlog summary, one bit per sector that may hold unsent records
+	static uint8_t backlogSectors[(MAX_SECTOR + 7) / 8];
+#ifndef SECTOR_TABLE_LRU_SIZE
+	static uint8_t sectorTableLoaded[(MAX_SECTOR + 7) / 8];   //one bit per descriptor read
+#else
+	static uint16_t sectorTableTags[SECTOR_TABLE_SIZE];
+	static uint16_t sectorTableStamps[SECTOR_TABLE_SIZE];
+	static uint16_t sectorTableClock;
+#endif
+#ifdef MOUNT_CHECKPOINT
+	//Active and earliest backlog sectors of every stream in the latest entry
+	static uint16_t checkpointHeads[STREAM_COUNT];
+	static uint16_t checkpointTails[STREAM_COUNT];
+	static uint16_t checkpointCount;   //entries used, NO_SECTOR_DESCRIPTOR until read
+#endif
+	//Records written during a pre-erase, not programmed yet
+#if PRE_ERASE_BUFFER_SIZE > 0
+	static uint8_t heldRecords[PRE_ERASE_BUFFER_SIZE];
+#endif
+	static uint32_t heldAddress;
+	static uint16_t heldLength;
+	static uint8_t heldStream;
+#ifdef PAGE_CACHE_SIZE
+	//Page cache, tags are stored as page index + 1, 32 bits so that pages
+	//above 16 MB do not share tags
+	static uint8_t pageCache[PAGE_CACHE_SIZE][CACHE_PAGE_SIZE];
+	static uint32_t pageCacheTags[PAGE_CACHE_SIZE];
+	static uint16_t pageCacheStamps[PAGE_CACHE_SIZE];
+	static uint16_t pageCacheClock;
+	static bool pageCacheAhead[PAGE_CACHE_SIZE];   //read ahead, not read yet
+	static uint32_t recentPages[RECENT_PAGES];     //tags of the latest pages read
+	static PageCacheStats_t pageCacheStats;
+#endif
 
 public:
 	void init();
-	void writeRecord(const void *record, uint8_t recordSize);
+	RecordAddress_t writeRecord(const void *record, uint8_t recordSize);
 	uint16_t readRecord(RecordAddress_t recordAddress, void *buf);
 	uint16_t readRecords(RecordAddress_t* recordAddresses, uint16_t length, void *buf);
+	uint16_t readRecords(RecordAddress_t* recordAddresses, uint16_t length, void *buf, uint8_t *recordSizes);
 	void markRecordSent(RecordAddress_t recordAddr);
 	void markRecordsSent(RecordAddress_t* recordAddresses, uint16_t length);
+	void markRangeSent(RecordAddress_t from, RecordAddress_t to);
 	void markLatestWrittenRecordSent();
 	uint16_t getLatestWrittenRecordSector();
 	uint16_t getLatestWrittenRecordIndex(uint16_t sectorIndex);
@@ -71,10 +309,41 @@ public:
 	uint16_t getLatestBacklogIndex(uint16_t sectorIndex);
 	uint16_t getLatestBacklogIndex(uint16_t sectorIndex, uint16_t preceding);
 	uint16_t retrieveLatestBacklogsAddresses(uint8_t payloadSize, RecordAddress_t *addresses);
+	uint16_t retrievePackedBacklogsAddresses(uint8_t payloadSize, RecordAddress_t *addresses, uint8_t *offsets);
 
 	uint16_t getNextRecordIndexForSector(uint16_t sectorIndex);
+	uint8_t getRecordSizeForSector(uint16_t sectorIndex);
+	uint8_t getRecordSize(RecordAddress_t recordAddress);
+	bool isRecordSent(RecordAddress_t recordAddress);
 	uint16_t getCurrentSectorIndex();
 	uint16_t getNextRecordIndex();
+	SectorStats_t getSectorStats(uint16_t sectorIndex);
+	BacklogReport_t getBacklogReport();
+
+	void setStream(uint8_t streamIndex);
+	uint8_t getStream();
+	static void setPartition(uint16_t firstSector, uint16_t sectorCount);
+	static uint16_t getPartitionStart();
+	static uint16_t getPartitionSectors();
+	static uint16_t getStreamSectors();
+	static bool isPartitionSector(uint16_t sectorIndex);
+	static uint16_t nextSector(uint16_t sectorIndex);
+	static uint16_t previousSector(uint16_t sectorIndex);
+
+	static void invalidateSectorTable();
+	static void flushBitmapCache();
+
+#ifdef PAGE_CACHE_SIZE
+	//From SerialFlashChip, through the page cache
+	static void read(uint32_t addr, void *buf, uint32_t len);
+	static void write(uint32_t addr, const void *buf, uint32_t len);
+	static void writeAsync(uint32_t addr, const void *buf, uint32_t len);
+	static void eraseAll();
+	static void eraseBlock(uint32_t addr);
+	static void eraseSector(uint32_t addr);
+	static const PageCacheStats_t &getPageCacheStats();
+	static void resetPageCacheStats();
+#endif
 
 protected:
 	bool isBlankState(uint8_t flag);
@@ -87,8 +356,17 @@ protected:
 	void setFlags(uint16_t recordSize, uint8_t unsentState, uint8_t activeState);
 	uint8_t getActiveFlag(uint16_t sectorIndex);
 	SectorFlags_t retrieveSectorFlag(uint16_t sectorIndex);
+	uint16_t capacityForRecordSize(uint8_t recordSize);
+
+	//Functions related to the sector descriptor table
+	void loadSectorDescriptor(uint16_t sectorIndex, SectorDescriptor_t *descriptor);
+	SectorDescriptor_t *getSectorDescriptor(uint16_t sectorIndex);
+	SectorDescriptor_t *findSectorDescriptor(uint16_t sectorIndex);
 
 	//Functions related to sectors
+	static StreamState_t *streamState(uint16_t sectorIndex);
+	void resolveGeometry();
+	uint16_t firstStreamSector();
 	void searchActiveSector();
 	void sequentialSearchActiveSector();
 	void deactivateCurrentSector();
@@ -96,21 +374,65 @@ protected:
 	void activateBlankSector(uint8_t recordSize);
 	void activateNextSector(uint8_t recordSize);
 	void reactivateCurrentSector(uint8_t recordSize);
+	void preEraseNextSector();
+	void writeRecordData(uint32_t addr, const uint8_t *data, uint16_t length);
+	static void flushHeldRecords();
+#ifdef MOUNT_CHECKPOINT
+	static uint16_t checkpointSector();
+	void loadCheckpoint();
+	uint16_t checkpointHead();
+	void writeCheckpoint();
+	static uint8_t checkpointCheckByte(const uint8_t *entry);
+#endif
 
+	//Functions related to the active sector bitmap cache
+	void loadBitmapCache(uint16_t sectorIndex);
+	void resetBitmapCache(uint16_t sectorIndex, uint16_t length);
+	void readUnsentBits(uint16_t sectorIndex, uint8_t *buf, uint16_t length);
+	void readUnsentBits(uint16_t sectorIndex, uint8_t *buf, uint16_t firstByte, uint16_t length);
+	static void markBitmapDirty(StreamState_t *state, uint16_t start, uint16_t end);
+	static void flushStreamBitmap(StreamState_t *state);
+	static void commitRecordBits(StreamState_t *state);
+	void recoverUncommittedRecords();
+	uint16_t recoverVariableRecords(uint16_t first, uint16_t *retired);
+
+	//Functions related to variable length records
+	bool recordFits(uint8_t recordSize);
+	uint16_t getDataEnd();
+	void appendRecordEnd(uint16_t end);
+	void readRecordEnds(uint16_t sectorIndex, uint16_t first, uint16_t count, uint16_t *ends);
+	static uint32_t recordEndAddress(uint16_t sectorIndex, uint16_t recordIndex);
+	static uint16_t payloadLength(const uint16_t *ends, uint16_t c);
+	uint16_t readPayloads(uint16_t sectorIndex, const uint16_t *ends, uint16_t count, uint8_t headerSize, uint8_t *payloads);
 	//Functions related to record index
 	void incrementRecordIndex();
 	void updateRecordPositionBit(uint16_t pos);
 
 	//Functions related to unsent sector and backlog
-	uint16_t nextLatestBacklogIndex(uint32_t addr, uint16_t preceding);
+	void loadBacklogSummary(uint16_t earliest);
+	void setBacklogSector(uint16_t sectorIndex);
+	void clearBacklogSector(uint16_t sectorIndex);
+	uint16_t seekBacklogSector(uint16_t sectorIndex, bool forward);
+	uint16_t nextLatestBacklogIndex(uint16_t sectorIndex, uint16_t preceding);
+	void clearUnsentBits(uint16_t sectorIndex, uint16_t firstByte, uint8_t *mask, uint16_t length);
 	void markSectorSent(uint16_t sectorIndex);
+	uint32_t countUnsentRecords();
+	void dropUnsentRecords(uint16_t sectorIndex);
+
+#ifdef PAGE_CACHE_SIZE
+	//Functions related to the page cache
+	static uint8_t *cachedPage(uint32_t page);
+	static uint8_t pageCacheSlot(uint32_t page);
+	static uint8_t pageCacheVictim(uint8_t slots);
+	static void updateCachedPages(uint32_t addr, const uint8_t *data, uint32_t len);
+	static void dropCachedPages(uint32_t addr, uint32_t len);
+#endif
 
 	//Basic functions
-	uint16_t ctz(uint8_t x);
-	uint16_t clz(uint8_t x);
-	uint16_t countTrailingZeroes(uint8_t* positionBytes, uint32_t length);
-	uint16_t countLeadingZeroes(uint8_t* positionBytes, uint32_t length);
-	uint16_t ceiling(uint16_t numerator, uint16_t denominator);
+	void reverseRecords(uint8_t *records, uint16_t count, uint8_t recordSize);
+	void reverseBytes(uint8_t *bytes, uint16_t length);
+	void reverseVariableRecords(uint8_t *records, uint16_t *ends, uint16_t count);
+	static uint8_t recordCheckByte(uint8_t seed, const uint8_t *record, uint8_t recordSize);
 };
 
 #endif
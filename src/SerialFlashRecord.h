@@ -7,27 +7,20 @@ class SerialFlashRecord : virtual public SerialFlashLayout {
 
 private:
   RecordAddress_t address;
-  uint8_t buf[242];
-  uint8_t recordSize;
+  uint8_t recordSize;           // RECORD_SIZE_UNKNOWN until it is asked for
+
+  static const uint8_t RECORD_SIZE_UNKNOWN = 0;
 
 public:
+  //Only the address is kept, the record is read when its content is asked for
   SerialFlashRecord(uint16_t sectorIndex, uint16_t recordIndex) {
     address.sectorIndex = sectorIndex;
     address.recordIndex = recordIndex;
-    recordSize = readRecord(address, buf);
+    recordSize = RECORD_SIZE_UNKNOWN;
   }
 
   bool hasBeenSent() {
-    uint16_t recordIndex = getLatestBacklogIndex(address.sectorIndex);
-
-    while(recordIndex != NO_BACKLOG_RECORD) {
-      if(recordIndex == address.recordIndex) {
-        return false;
-      }
-      recordIndex = getLatestBacklogIndex(address.sectorIndex, recordIndex);
-    }
-
-    return true;
+    return isRecordSent(address);
   }
 
   void markSent() {
@@ -35,17 +28,21 @@ public:
   }
 
   uint8_t getRecordSize() {
+    if (recordSize == RECORD_SIZE_UNKNOWN && address.recordIndex < getNextRecordIndexForSector(address.sectorIndex)) {
+      recordSize = SerialFlashLayout::getRecordSize(address);
+    }
     return recordSize;
   }
 
   uint8_t readContent(uint8_t *record) {
-    for (int i = 0; i < recordSize; i++) {
-      record[i] = buf[i];
-    }
+    uint16_t size = readRecord(address, record);
+    recordSize = size == INVALID_ADDRESS ? 0 : size;
     return recordSize;
   }
 
   String getHexString() {
+    uint8_t buf[MAX_PAYLOAD_SIZE];
+    readContent(buf);
     String ret = "";
     for (int i = 0; i < recordSize; i++) {
       String hex = String(buf[i], HEX);
@@ -18,6 +18,10 @@ public:
     flags = retrieveSectorFlag(index);
   }
 
+  uint16_t getSectorIndex() {
+    return sectorIndex;
+  }
+
   uint8_t getActiveFlag() {
     return flags.active_flag;
   }
@@ -39,14 +43,15 @@ public:
   }
 
   uint16_t getUnsentCount() {
-    uint16_t unsentCount = 0;
-    uint16_t recordIndex = getLatestBacklogIndex(sectorIndex);
-
-    while(recordIndex != NO_BACKLOG_RECORD) {
-      unsentCount++;
-      recordIndex = getLatestBacklogIndex(sectorIndex, recordIndex);
+    //kept up to date in the sector descriptor table
+    if (!isPartitionSector(sectorIndex)) {
+      return 0;
     }
-    return unsentCount;
+    return getSectorDescriptor(sectorIndex)->unsent;
+  }
+
+  SectorStats_t getStats() {
+    return getSectorStats(sectorIndex);
   }
 
   bool isActive() {
@@ -60,7 +65,7 @@ public:
   bool verifyBlank() {
     uint8_t buf[PAGE_LENGTH];
     for (int i = 0; i < SECTOR_SIZE; i += PAGE_LENGTH) {
-      uint32_t checkAddr = (sectorIndex * SECTOR_SIZE) + i;
+      uint32_t checkAddr = SectorGeometry::sectorAddress(sectorIndex) + i;
       read(checkAddr, buf, PAGE_LENGTH);
 
       for (int i = 0; i < PAGE_LENGTH; i++) {
@@ -0,0 +1,123 @@
+#include "SerialFlash_bitmap.h"
+#include <stddef.h>
+#include <string.h>
+
+// Words are only used on little endian targets, where bit n of an aligned
+// word is bit n of the bitmap starting at that word
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SERIALFLASH_BITMAP_WORDS
+#endif
+
+// Whether the 4 bytes at p can be loaded as one aligned word (the Cortex-M0+
+// faults on unaligned loads)
+static inline bool wordAligned(const uint8_t *p)
+{
+#ifdef SERIALFLASH_BITMAP_WORDS
+	return ((uintptr_t)p & 3) == 0;
+#else
+	return false;
+#endif
+}
+
+static inline uint32_t loadWord(const uint8_t *p)
+{
+	uint32_t w;
+	memcpy(&w, __builtin_assume_aligned(p, 4), 4);
+	return w;
+}
+
+// Set bits of a word without the libgcc call, a handful of shifts and one
+// multiply on the Cortex-M0+
+static inline uint8_t popcount(uint32_t w)
+{
+	w = w - ((w >> 1) & 0x55555555);
+	w = (w & 0x33333333) + ((w >> 2) & 0x33333333);
+	return (((w + (w >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+uint16_t SerialFlashBitmap::findFirstSet(const uint8_t *bits, uint16_t from, uint16_t end)
+{
+	if (from >= end) return end;
+	uint16_t byte = from >> 3;
+	uint16_t last = (end - 1) >> 3;
+	uint8_t x = bits[byte] & (0xFF << (from & 7));
+	while (x == 0) {
+		if (++byte > last) return end;
+		// bits of the last word past end are cut off below
+		while (byte + 3 <= last && wordAligned(bits + byte)) {
+			uint32_t w = loadWord(bits + byte);
+			if (w != 0) {
+				uint16_t pos = (byte << 3) + __builtin_ctz(w);
+				return pos < end ? pos : end;
+			}
+			byte += 4;
+		}
+		if (byte > last) return end;
+		x = bits[byte];
+	}
+	uint16_t pos = (byte << 3) + lowestSet(x);
+	return pos < end ? pos : end;
+}
+
+uint16_t SerialFlashBitmap::findLastSet(const uint8_t *bits, uint16_t from, uint16_t end)
+{
+	if (from >= end) return SERIALFLASH_NO_BIT;
+	int32_t first = from >> 3;
+	int32_t byte = (end - 1) >> 3;
+	uint8_t x = bits[byte] & (0xFF >> (7 - ((end - 1) & 7)));
+	while (x == 0) {
+		if (--byte < first) return SERIALFLASH_NO_BIT;
+		// bits of the first word before from are cut off below
+		while (byte - 3 >= first && wordAligned(bits + byte - 3)) {
+			uint32_t w = loadWord(bits + byte - 3);
+			if (w != 0) {
+				uint16_t pos = ((byte - 3) << 3) + 31 - __builtin_clz(w);
+				return pos >= from ? pos : SERIALFLASH_NO_BIT;
+			}
+			byte -= 4;
+		}
+		if (byte < first) return SERIALFLASH_NO_BIT;
+		x = bits[byte];
+	}
+	uint16_t pos = (byte << 3) + highestSet(x);
+	return pos >= from ? pos : SERIALFLASH_NO_BIT;
+}
+
+uint16_t SerialFlashBitmap::countSet(const uint8_t *bits, uint16_t from, uint16_t end)
+{
+	if (from >= end) return 0;
+	uint16_t byte = from >> 3;
+	uint16_t last = (end - 1) >> 3;
+	uint8_t head = 0xFF << (from & 7);
+	uint8_t tail = 0xFF >> (7 - ((end - 1) & 7));
+	if (byte == last) return popcount(bits[byte] & head & tail);
+
+	uint16_t count = popcount(bits[byte++] & head);
+	while (byte < last && !wordAligned(bits + byte)) {
+		count += popcount(bits[byte++]);
+	}
+	while (byte + 4 <= last) {
+		count += popcount(loadWord(bits + byte));
+		byte += 4;
+	}
+	while (byte < last) {
+		count += popcount(bits[byte++]);
+	}
+	return count + popcount(bits[last] & tail);
+}
+
+void SerialFlashBitmap::clearRange(uint8_t *bits, uint16_t from, uint16_t end)
+{
+	if (from >= end) return;
+	uint16_t first = from >> 3;
+	uint16_t last = (end - 1) >> 3;
+	uint8_t head = 0xFF << (from & 7);
+	uint8_t tail = 0xFF >> (7 - ((end - 1) & 7));
+	if (first == last) {
+		bits[first] &= ~(head & tail);
+		return;
+	}
+	bits[first] &= ~head;
+	memset(bits + first + 1, 0, last - first - 1);
+	bits[last] &= ~tail;
+}
@@ -0,0 +1,33 @@
+#ifndef SerialFlash_bitmap_h
+#define SerialFlash_bitmap_h
+
+#include <inttypes.h>
+
+// Scans of the written, unsent and summary bitmaps. Bit n is bit n % 8 of
+// byte n / 8. Positions are bit indices, ranges are [from, end). Bytes up to
+// the first 32-bit boundary are scanned one at a time, then whole words, so
+// a run of empty bytes costs one compare per 4 bytes instead of one per byte.
+
+#define SERIALFLASH_NO_BIT	(uint16_t) -1
+
+class SerialFlashBitmap
+{
+public:
+	// First set bit in [from, end), end when there is none
+	static uint16_t findFirstSet(const uint8_t *bits, uint16_t from, uint16_t end);
+	// Last set bit in [from, end), SERIALFLASH_NO_BIT when there is none
+	static uint16_t findLastSet(const uint8_t *bits, uint16_t from, uint16_t end);
+	// Last set bit before pos
+	static uint16_t findLastSetBefore(const uint8_t *bits, uint16_t pos) {
+		return findLastSet(bits, 0, pos);
+	}
+	// Set bits in [from, end)
+	static uint16_t countSet(const uint8_t *bits, uint16_t from, uint16_t end);
+	// Clears the bits in [from, end), the others are left as they are
+	static void clearRange(uint8_t *bits, uint16_t from, uint16_t end);
+	// Lowest and highest set bit of a non zero byte
+	static uint8_t lowestSet(uint8_t x) { return __builtin_ctz(x); }
+	static uint8_t highestSet(uint8_t x) { return 31 - __builtin_clz(x); }
+};
+
+#endif
@@ -0,0 +1,150 @@
+#include "../SerialFlashChip.h"
+
+#ifdef SERIALFLASH_USE_DMA
+
+// only used when no other library has enabled the DMAC before begin()
+static DmacDescriptor descriptors[DMAC_CH_NUM] __attribute__((aligned(16)));
+static DmacDescriptor writeback[DMAC_CH_NUM] __attribute__((aligned(16)));
+static uint8_t dummy;
+
+volatile bool SerialFlashDMA::busy = false;
+void (*SerialFlashDMA::doneHook)() = NULL;
+void (*SerialFlashDMA::callback)() = NULL;
+uint8_t SerialFlashDMA::txChannel = SERIALFLASH_DMA_NO_CHANNEL;
+uint8_t SerialFlashDMA::rxChannel = SERIALFLASH_DMA_NO_CHANNEL;
+
+// CHID selects the channel of every CH register, interrupts of other DMA
+// users must not change it in between
+#define CHANNEL_LOCK()		uint32_t primask = __get_PRIMASK(); __disable_irq()
+#define CHANNEL_UNLOCK()	__set_PRIMASK(primask)
+
+static void setupChannel(uint8_t channel, uint8_t trigger)
+{
+	DMAC->CHID.reg = DMAC_CHID_ID(channel);
+	DMAC->CHCTRLA.reg &= ~DMAC_CHCTRLA_ENABLE;
+	DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+	DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL(0) | DMAC_CHCTRLB_TRIGSRC(trigger)
+		| DMAC_CHCTRLB_TRIGACT_BEAT;
+	DMAC->CHINTENCLR.reg = DMAC_CHINTENCLR_MASK;
+}
+
+void SerialFlashDMA::begin()
+{
+	static bool started = false;
+	if (started) return;
+	started = true;
+
+	PM->AHBMASK.reg |= PM_AHBMASK_DMAC;
+	PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
+	CHANNEL_LOCK();
+	if (!(DMAC->CTRL.reg & DMAC_CTRL_DMAENABLE)) {
+		// first user of the DMAC, the descriptor tables are ours
+		DMAC->BASEADDR.reg = (uint32_t)descriptors;
+		DMAC->WRBADDR.reg = (uint32_t)writeback;
+		DMAC->CTRL.reg = DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xF);
+	}
+
+	// channels are taken from the top, allocators of other libraries start
+	// from channel 0. A channel is free when it was never configured.
+	for (int8_t channel = DMAC_CH_NUM - 1; channel >= 0; channel--) {
+		DMAC->CHID.reg = DMAC_CHID_ID(channel);
+		if ((DMAC->CHCTRLA.reg & DMAC_CHCTRLA_ENABLE) || DMAC->CHCTRLB.reg != 0) continue;
+		if (txChannel == SERIALFLASH_DMA_NO_CHANNEL) {
+			txChannel = channel;
+		} else {
+			rxChannel = channel;
+			break;
+		}
+	}
+	if (rxChannel == SERIALFLASH_DMA_NO_CHANNEL) {
+		txChannel = SERIALFLASH_DMA_NO_CHANNEL;
+		CHANNEL_UNLOCK();
+		return;
+	}
+
+	setupChannel(txChannel, SERIALFLASH_DMA_TX_TRIGGER);
+	setupChannel(rxChannel, SERIALFLASH_DMA_RX_TRIGGER);
+#ifdef SERIALFLASH_DMA_ISR
+	// the last received byte marks the end of the transfer
+	DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL;
+	NVIC_EnableIRQ(DMAC_IRQn);
+#endif
+	CHANNEL_UNLOCK();
+}
+
+void SerialFlashDMA::transfer(const uint8_t *tx, uint8_t *rx, uint16_t len, void (*done)())
+{
+	volatile void *data = &SERIALFLASH_DMA_SERCOM->SPI.DATA.reg;
+	DmacDescriptor *txd = (DmacDescriptor *)DMAC->BASEADDR.reg + txChannel;
+	DmacDescriptor *rxd = (DmacDescriptor *)DMAC->BASEADDR.reg + rxChannel;
+
+	// incrementing addresses point one past the end of the buffer
+	dummy = 0;
+	txd->BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE
+		| (tx ? DMAC_BTCTRL_SRCINC : 0);
+	txd->BTCNT.reg = len;
+	txd->SRCADDR.reg = tx ? (uint32_t)(tx + len) : (uint32_t)&dummy;
+	txd->DSTADDR.reg = (uint32_t)data;
+	txd->DESCADDR.reg = 0;
+
+	rxd->BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE
+		| (rx ? DMAC_BTCTRL_DSTINC : 0);
+	rxd->BTCNT.reg = len;
+	rxd->SRCADDR.reg = (uint32_t)data;
+	rxd->DSTADDR.reg = rx ? (uint32_t)(rx + len) : (uint32_t)&dummy;
+	rxd->DESCADDR.reg = 0;
+
+	doneHook = done;
+	busy = true;
+	CHANNEL_LOCK();
+	DMAC->CHID.reg = DMAC_CHID_ID(rxChannel);
+	DMAC->CHCTRLA.reg |= DMAC_CHCTRLA_ENABLE;
+	DMAC->CHID.reg = DMAC_CHID_ID(txChannel);
+	DMAC->CHCTRLA.reg |= DMAC_CHCTRLA_ENABLE;
+	CHANNEL_UNLOCK();
+}
+
+bool SerialFlashDMA::active()
+{
+#ifndef SERIALFLASH_DMA_ISR
+	if (busy) complete();
+#endif
+	return busy;
+}
+
+void SerialFlashDMA::wait()
+{
+#ifdef SERIALFLASH_DMA_ISR
+	// sleep until the DMAC interrupt, SysTick wakes us up if it was missed
+	while (busy) {
+		__WFI();
+	}
+#else
+	while (busy) {
+		complete();
+	}
+#endif
+}
+
+void SerialFlashDMA::complete()
+{
+	if (rxChannel == SERIALFLASH_DMA_NO_CHANNEL) return;
+	CHANNEL_LOCK();
+	DMAC->CHID.reg = DMAC_CHID_ID(rxChannel);
+	bool finished = DMAC->CHINTFLAG.reg & DMAC_CHINTFLAG_TCMPL;
+	if (finished) DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_TCMPL;
+	CHANNEL_UNLOCK();
+	if (!finished) return;
+	if (doneHook) doneHook();
+	busy = false;
+	if (callback) callback();
+}
+
+#ifdef SERIALFLASH_DMA_ISR
+extern "C" void DMAC_Handler(void)
+{
+	SerialFlashDMA::complete();
+}
+#endif
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef SerialFlash_dma_h
+#define SerialFlash_dma_h
+
+#include <inttypes.h>
+#include "Arduino.h"
+
+// Optional DMA transport for SerialFlashChip, enabled by defining
+// SERIALFLASH_USE_DMA. Only the SAMD21 DMAC is supported, other platforms
+// keep sending one byte at a time through SPIClass.
+
+#if defined(SERIALFLASH_USE_DMA) && !(defined(ARDUINO_ARCH_SAMD) && defined(DMAC))
+#undef SERIALFLASH_USE_DMA
+#endif
+
+#ifdef SERIALFLASH_USE_DMA
+
+// SERCOM of the SPI port wired to the flash chip (SPI1 on the MKRWAN 1310)
+#ifndef SERIALFLASH_DMA_SERCOM
+#define SERIALFLASH_DMA_SERCOM        SERCOM4
+#define SERIALFLASH_DMA_TX_TRIGGER    SERCOM4_DMAC_ID_TX
+#define SERIALFLASH_DMA_RX_TRIGGER    SERCOM4_DMAC_ID_RX
+#endif
+
+// Shorter transfers are not worth setting up the DMAC for
+#ifndef SERIALFLASH_DMA_MIN_LENGTH
+#define SERIALFLASH_DMA_MIN_LENGTH    16
+#endif
+
+// The DMAC interrupt vector is left to the sketch or to another DMA library,
+// completion is then polled by wait() and active(). Define SERIALFLASH_DMA_ISR
+// when nothing else defines DMAC_Handler to let SerialFlashDMA define it.
+//#define SERIALFLASH_DMA_ISR
+
+#define SERIALFLASH_DMA_NO_CHANNEL    0xFF
+
+class SerialFlashDMA
+{
+public:
+	// Takes the two highest channels that no one has configured, without
+	// resetting the DMAC. Transfers fall back to SPIClass when none are free.
+	static void begin();
+	static bool available() { return rxChannel != SERIALFLASH_DMA_NO_CHANNEL; }
+	// Sends tx (or zeros when tx is NULL) and stores the received bytes in
+	// rx (or discards them when rx is NULL). Returns at once, done() is then
+	// called by complete() once the last byte has been shifted.
+	static void transfer(const uint8_t *tx, uint8_t *rx, uint16_t len, void (*done)());
+	static bool active();
+	static void wait();
+	static void (*callback)();	// user code to run when a transfer completes
+	// Call from a DMAC_Handler defined outside of the library
+	static void complete();
+private:
+	static volatile bool busy;
+	static void (*doneHook)();
+	static uint8_t txChannel;
+	static uint8_t rxChannel;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+#include "../SerialFlashChip.h"
+
+#ifdef SERIALFLASH_STATS
+
+SerialFlashStats_t SerialFlashProfiler::stats;
+
+static const char *operationNames[SERIALFLASH_OP_COUNT] = {
+	"beginWork", "endWork", "writeRecord", "readRecord", "readRecords",
+	"markRecordSent", "markRecordsSent", "markRangeSent",
+	"markLatestWrittenRecordSent", "retrieveLatestBacklogsAddresses",
+	"getNextBacklogAddress", "queries", "read", "write", "writeAsync",
+	"ready", "erase"
+};
+
+void SerialFlashProfiler::reset()
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+void SerialFlashProfiler::record(uint8_t op, uint32_t elapsed)
+{
+	SerialFlashLatency_t *l = &stats.latency[op];
+	uint8_t b = 0;
+	while (b < SERIALFLASH_STATS_BUCKETS - 1 && (elapsed >> (b + 1))) b++;
+	l->buckets[b]++;
+	l->calls++;
+	l->totalMicros += elapsed;
+	if (elapsed > l->maxMicros) l->maxMicros = elapsed;
+}
+
+const char *SerialFlashProfiler::operationName(uint8_t op)
+{
+	return op < SERIALFLASH_OP_COUNT ? operationNames[op] : "";
+}
+
+static void printCounter(Print &out, const char *name, uint32_t value)
+{
+	out.print(name);
+	out.print(": ");
+	out.println(value);
+}
+
+void SerialFlashProfiler::print(Print &out)
+{
+	printCounter(out, "commands", stats.commands);
+	printCounter(out, "bytesRead", stats.bytesRead);
+	printCounter(out, "bytesWritten", stats.bytesWritten);
+	printCounter(out, "programs", stats.programs);
+	printCounter(out, "sectorErases", stats.sectorErases);
+	printCounter(out, "blockErases", stats.blockErases);
+	printCounter(out, "chipErases", stats.chipErases);
+	printCounter(out, "eraseSuspends", stats.eraseSuspends);
+	printCounter(out, "waitPolls", stats.waitPolls);
+	printCounter(out, "descriptorLoads", stats.descriptorLoads);
+	printCounter(out, "bitmapPrograms", stats.bitmapPrograms);
+	printCounter(out, "sectorActivations", stats.sectorActivations);
+	printCounter(out, "preErases", stats.preErases);
+	printCounter(out, "backlogScanSteps", stats.backlogScanSteps);
+
+	// one line per call: count, average and worst case, then the non empty
+	// buckets as <limit:count
+	for (uint8_t op = 0; op < SERIALFLASH_OP_COUNT; op++) {
+		const SerialFlashLatency_t *l = &stats.latency[op];
+		if (!l->calls) continue;
+		out.print(operationName(op));
+		out.print(": calls ");
+		out.print(l->calls);
+		out.print(" avg ");
+		out.print((uint32_t) (l->totalMicros / l->calls));
+		out.print("us max ");
+		out.print(l->maxMicros);
+		out.print("us");
+		for (uint8_t b = 0; b < SERIALFLASH_STATS_BUCKETS; b++) {
+			if (!l->buckets[b]) continue;
+			out.print(b < SERIALFLASH_STATS_BUCKETS - 1 ? " <" : " >=");
+			out.print(1ul << (b < SERIALFLASH_STATS_BUCKETS - 1 ? b + 1 : b));
+			out.print(":");
+			out.print(l->buckets[b]);
+		}
+		out.println();
+	}
+}
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef SerialFlash_stats_h
+#define SerialFlash_stats_h
+
+#include <inttypes.h>
+#include "Arduino.h"
+
+// Optional counters and latency histograms, enabled by defining
+// SERIALFLASH_STATS. Without it the macros below expand to nothing and the
+// library is built exactly as before.
+
+#ifdef SERIALFLASH_STATS
+
+// Bucket b counts calls that took less than 2^(b+1) microseconds, the last
+// bucket also counts every slower call
+#ifndef SERIALFLASH_STATS_BUCKETS
+#define SERIALFLASH_STATS_BUCKETS     16
+#endif
+
+// Public CustoFlash calls with their own latency histogram
+enum SerialFlashOperation {
+	SERIALFLASH_OP_BEGIN_WORK,
+	SERIALFLASH_OP_END_WORK,
+	SERIALFLASH_OP_WRITE_RECORD,
+	SERIALFLASH_OP_READ_RECORD,
+	SERIALFLASH_OP_READ_RECORDS,
+	SERIALFLASH_OP_MARK_RECORD_SENT,
+	SERIALFLASH_OP_MARK_RECORDS_SENT,
+	SERIALFLASH_OP_MARK_RANGE_SENT,
+	SERIALFLASH_OP_MARK_LATEST_SENT,
+	SERIALFLASH_OP_RETRIEVE_BACKLOGS,
+	SERIALFLASH_OP_NEXT_BACKLOG,
+	SERIALFLASH_OP_QUERY,		// getters of sectors, records and backlogs
+	SERIALFLASH_OP_READ,
+	SERIALFLASH_OP_WRITE,
+	SERIALFLASH_OP_WRITE_ASYNC,
+	SERIALFLASH_OP_READY,
+	SERIALFLASH_OP_ERASE,
+	SERIALFLASH_OP_COUNT
+};
+
+typedef struct SerialFlashLatency {
+	uint32_t calls;
+	uint32_t maxMicros;
+	uint64_t totalMicros;
+	uint32_t buckets[SERIALFLASH_STATS_BUCKETS];
+} SerialFlashLatency_t;
+
+typedef struct SerialFlashStats {
+	// SerialFlashChip
+	uint32_t commands;		// SPI commands, one per chip select
+	uint32_t bytesRead;
+	uint32_t bytesWritten;
+	uint32_t programs;		// page programs
+	uint32_t sectorErases;
+	uint32_t blockErases;
+	uint32_t chipErases;
+	uint32_t eraseSuspends;	// reads and writes let through a running erase
+	uint32_t waitPolls;		// status reads while waiting for the chip
+	// SerialFlashLayout
+	uint32_t descriptorLoads;	// sector tails read into the sector table
+	uint32_t bitmapPrograms;	// commits and flushes of the active sector bitmaps
+	uint32_t sectorActivations;
+	uint32_t preErases;
+	uint32_t backlogScanSteps;	// sectors visited looking for a backlog
+	// CustoFlash
+	SerialFlashLatency_t latency[SERIALFLASH_OP_COUNT];
+} SerialFlashStats_t;
+
+class SerialFlashProfiler
+{
+public:
+	static SerialFlashStats_t stats;
+	static void reset();
+	static void record(uint8_t op, uint32_t elapsed);
+	static void print(Print &out);
+	static const char *operationName(uint8_t op);
+};
+
+// Records the time spent in the enclosing scope
+class SerialFlashTimer
+{
+public:
+	SerialFlashTimer(uint8_t op) : op(op), start(micros()) {}
+	~SerialFlashTimer() { SerialFlashProfiler::record(op, micros() - start); }
+private:
+	uint8_t op;
+	uint32_t start;
+};
+
+#define SERIALFLASH_STAT(field, n)	(SerialFlashProfiler::stats.field += (n))
+#define SERIALFLASH_TIME(op)		SerialFlashTimer serialFlashTimer(op)
+
+#else
+
+#define SERIALFLASH_STAT(field, n)	((void) 0)
+#define SERIALFLASH_TIME(op)
+
+#endif
+
+#endif
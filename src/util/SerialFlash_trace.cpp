@@ -0,0 +1,91 @@
+#include "../SerialFlashChip.h"
+
+#ifdef SERIALFLASH_TRACE
+
+SerialFlashTraceEntry_t SerialFlashTrace::entries[SERIALFLASH_TRACE_SIZE];
+uint16_t SerialFlashTrace::head = 0;
+uint16_t SerialFlashTrace::count = 0;
+uint32_t SerialFlashTrace::dropped = 0;
+
+void SerialFlashTrace::record(const SerialFlashTraceEntry_t *entry)
+{
+	// the oldest entry is overwritten when the ring is full
+	entries[(head + count) % SERIALFLASH_TRACE_SIZE] = *entry;
+	if (count < SERIALFLASH_TRACE_SIZE) {
+		count++;
+	} else {
+		head = (head + 1) % SERIALFLASH_TRACE_SIZE;
+		dropped++;
+	}
+}
+
+void SerialFlashTrace::dump(Print &out)
+{
+	out.print("# CustoFlash trace, dropped ");
+	out.println(dropped);
+	for (uint16_t n = 0; n < count; n++) {
+		const SerialFlashTraceEntry_t *e = &entries[(head + n) % SERIALFLASH_TRACE_SIZE];
+		out.print("T ");
+		out.print(e->time, HEX);
+		out.print(' ');
+		out.print(e->elapsed, HEX);
+		out.print(' ');
+		out.print(e->op, HEX);
+		out.print(' ');
+		out.print(e->size, HEX);
+		out.print(' ');
+		out.print(e->arg, HEX);
+		out.print(' ');
+		out.print(e->value, HEX);
+		out.print(' ');
+		out.println(e->stream, HEX);
+	}
+}
+
+void SerialFlashTrace::clear()
+{
+	head = count = 0;
+	dropped = 0;
+}
+
+SerialFlashTraceCall::~SerialFlashTraceCall()
+{
+	SerialFlashTraceEntry_t e;
+	e.time = start;
+	e.elapsed = micros() - start;
+	e.op = op;
+	e.size = size;
+	e.arg = arg;
+	e.value = value;
+	e.stream = stream;
+	SerialFlashTrace::record(&e);
+
+	// addresses are uint16_t pairs, see RecordAddress_t, logged as runs of
+	// record indexes going up or down by one in the same sector
+	const uint16_t *a = (const uint16_t *) addresses;
+	e.elapsed = 0;
+	e.op = SERIALFLASH_TRACE_ADDRESS;
+	uint16_t n = 0;
+	for (uint16_t runs = 0; n < length && runs < SERIALFLASH_TRACE_ADDRESS_RUNS; runs++) {
+		uint16_t sector = a[2 * n];
+		uint16_t index = a[2 * n + 1];
+		uint16_t step = 0;
+		if (n + 1 < length && a[2 * n + 2] == sector) {
+			step = a[2 * n + 3] - index;
+		}
+		uint16_t run = 1;
+		if (step == 1 || step == (uint16_t) -1) {
+			while (n + run < length && a[2 * (n + run)] == sector
+				&& a[2 * (n + run) + 1] == (uint16_t) (index + run * step)) {
+				run++;
+			}
+		}
+		e.arg = ((uint32_t) sector << 16) | index;
+		e.size = run > 1 && step != 1;
+		e.value = run;
+		SerialFlashTrace::record(&e);
+		n += run;
+	}
+}
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef SerialFlash_trace_h
+#define SerialFlash_trace_h
+
+#include <inttypes.h>
+#include "Arduino.h"
+
+// Optional recorder of CustoFlash calls, enabled by defining
+// SERIALFLASH_TRACE. The latest SERIALFLASH_TRACE_SIZE entries are kept in a
+// RAM ring, dumpTrace() prints them for extras/host/custoflash_replay.cpp.
+// Without it the macros below expand to nothing.
+
+// Traced calls, record addresses are packed as sectorIndex << 16 | recordIndex
+enum SerialFlashTraceOp {
+	SERIALFLASH_TRACE_BEGIN_WORK,		// value: active sector and next record index
+	SERIALFLASH_TRACE_END_WORK,
+	SERIALFLASH_TRACE_WRITE_RECORD,		// size, arg: first 4 payload bytes, value: address
+	SERIALFLASH_TRACE_READ_RECORD,		// arg: address, value: size
+	SERIALFLASH_TRACE_READ_RECORDS,		// arg: count, value: bytes read, then count addresses
+	SERIALFLASH_TRACE_MARK_RECORD_SENT,	// arg: address
+	SERIALFLASH_TRACE_MARK_RECORDS_SENT,	// arg: count, then count addresses
+	SERIALFLASH_TRACE_MARK_RANGE_SENT,	// arg: first address, then the last address
+	SERIALFLASH_TRACE_MARK_LATEST_SENT,
+	SERIALFLASH_TRACE_LATEST_WRITTEN_SECTOR,	// value: sector
+	SERIALFLASH_TRACE_LATEST_WRITTEN_INDEX,	// arg: sector, value: index
+	SERIALFLASH_TRACE_EARLIEST_BACKLOG_SECTOR,	// value: sector
+	SERIALFLASH_TRACE_EARLIEST_BACKLOG_INDEX,	// arg: sector, value: index
+	SERIALFLASH_TRACE_LATEST_BACKLOG_SECTOR,	// value: sector
+	SERIALFLASH_TRACE_LATEST_BACKLOG_INDEX,	// arg: sector, value: index
+	SERIALFLASH_TRACE_LATEST_BACKLOG_BEFORE,	// arg: sector and preceding index, value: index
+	SERIALFLASH_TRACE_RETRIEVE_BACKLOGS,	// size: payload size, value: count, then count addresses
+	SERIALFLASH_TRACE_NEXT_RECORD_INDEX,	// arg: sector, value: index
+	SERIALFLASH_TRACE_NEXT_BACKLOG_ADDRESS,	// value: record size, then the address
+	SERIALFLASH_TRACE_READ,			// arg: flash address, value: length
+	SERIALFLASH_TRACE_WRITE,		// arg: flash address, value: length
+	SERIALFLASH_TRACE_WRITE_ASYNC,		// arg: flash address, value: length
+	SERIALFLASH_TRACE_ERASE_ALL,
+	SERIALFLASH_TRACE_ERASE_BLOCK,		// arg: flash address
+	SERIALFLASH_TRACE_ERASE_SECTOR,		// arg: flash address
+	SERIALFLASH_TRACE_ADDRESS,		// arg: first address of a run of the call before, value: run length, size: 1 when the indexes go down
+	SERIALFLASH_TRACE_RETRIEVE_PACKED,	// size: payload size, value: count, then count addresses
+	SERIALFLASH_TRACE_OP_COUNT
+};
+
+typedef struct SerialFlashTraceEntry {
+	uint32_t time;		// micros() when the call started
+	uint32_t elapsed;	// microseconds spent in the call
+	uint32_t arg;
+	uint32_t value;
+	uint8_t op;
+	uint8_t size;
+	uint8_t stream;		// stream of the record calls
+} SerialFlashTraceEntry_t;
+
+#ifdef SERIALFLASH_TRACE
+
+#ifndef SERIALFLASH_TRACE_SIZE
+#define SERIALFLASH_TRACE_SIZE	128
+#endif
+// Address arrays are logged as runs of consecutive record indexes of one
+// sector, one entry per run. At most SERIALFLASH_TRACE_ADDRESS_RUNS runs are
+// logged per call, so a large batch cannot push its own call out of the ring.
+#ifndef SERIALFLASH_TRACE_ADDRESS_RUNS
+#define SERIALFLASH_TRACE_ADDRESS_RUNS	8
+#endif
+#if SERIALFLASH_TRACE_ADDRESS_RUNS < 1 || SERIALFLASH_TRACE_ADDRESS_RUNS >= SERIALFLASH_TRACE_SIZE
+#error "SERIALFLASH_TRACE_ADDRESS_RUNS must be between 1 and SERIALFLASH_TRACE_SIZE - 1"
+#endif
+
+class SerialFlashTrace
+{
+public:
+	static void record(const SerialFlashTraceEntry_t *entry);
+	// Prints one "T time elapsed op size arg value stream" line of hex numbers per
+	// entry, oldest first, after a "#" line with the number of lost entries
+	static void dump(Print &out);
+	static void clear();
+	static uint32_t dropped;	// entries overwritten since the last clear()
+private:
+	static SerialFlashTraceEntry_t entries[SERIALFLASH_TRACE_SIZE];
+	static uint16_t head;
+	static uint16_t count;
+};
+
+// Records the enclosing call when it returns
+class SerialFlashTraceCall
+{
+public:
+	SerialFlashTraceCall(uint8_t stream, uint8_t op, uint8_t size, uint32_t arg)
+		: stream(stream), op(op), size(size), arg(arg), value(0), addresses(NULL),
+		length(0), start(micros()) {}
+	~SerialFlashTraceCall();
+	void setValue(uint32_t v) { value = v; }
+	void setAddresses(const void *p, uint16_t n) { addresses = p; length = n; }
+private:
+	uint8_t stream;
+	uint8_t op;
+	uint8_t size;
+	uint32_t arg;
+	uint32_t value;
+	const void *addresses;	// RecordAddress_t array logged after the call
+	uint16_t length;
+	uint32_t start;
+};
+
+#define SERIALFLASH_TRACE_CALL(stream, op, size, arg)	SerialFlashTraceCall serialFlashTraceCall(stream, op, size, arg)
+#define SERIALFLASH_TRACE_VALUE(v)		serialFlashTraceCall.setValue(v)
+#define SERIALFLASH_TRACE_ADDRESSES(p, n)	serialFlashTraceCall.setAddresses(p, n)
+
+#else
+
+#define SERIALFLASH_TRACE_CALL(stream, op, size, arg)
+#define SERIALFLASH_TRACE_VALUE(v)
+#define SERIALFLASH_TRACE_ADDRESSES(p, n)
+
+#endif
+
+#endif